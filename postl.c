@@ -1,11 +1,18 @@
 #define _GNU_SOURCE  // asprintf
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "postl.h"
 
@@ -19,21 +26,290 @@
 #endif
 #define DBGF(...) DBG(do {fprintf(stderr,__VA_ARGS__); fputc('\n',stderr);} while(0))
 
-#define HASHMAP_SIZE (127)
-
 
 __attribute__((noreturn)) static void outofmem(void){
 	fprintf(stderr,"postl: OUT OF MEMORY!\n");
 	exit(1);
 }
 
-// Murmur3 performed only slightly better (3 collisions instead of 5 for the
-// builtins) than this simple sum-of-characters.
-// Keeping this until I find something significantly better.
-static int namehash(const char *name){
-	int h=0,len=strlen(name);
-	for(int i=0;i<len;i++)h+=name[i];
-	return h%HASHMAP_SIZE;
+// Bump allocator: everything allocated in an arena is freed at once, in time
+// proportional to the number of chunks. Chunks double in size, up to a limit.
+typedef struct arena_chunk_t{
+	struct arena_chunk_t *next;
+	size_t size,used;
+	max_align_t data[];
+} arena_chunk_t;
+
+typedef struct arena_t{
+	arena_chunk_t *chunks; // the chunk being allocated from is first
+	size_t nextsize;
+} arena_t;
+
+#define ARENA_MIN_CHUNK (256)
+#define ARENA_MAX_CHUNK (65536)
+
+static void arena_init(arena_t *arena){
+	arena->chunks=NULL;
+	arena->nextsize=ARENA_MIN_CHUNK;
+}
+
+static void* arena_alloc(arena_t *arena,size_t size){
+	size=(size+sizeof(max_align_t)-1)/sizeof(max_align_t)*sizeof(max_align_t);
+	arena_chunk_t *chunk=arena->chunks;
+	if(chunk&&chunk->size-chunk->used>=size){
+		void *p=(char*)chunk->data+chunk->used;
+		chunk->used+=size;
+		return p;
+	}
+	size_t csize=arena->nextsize;
+	if(csize<size)csize=size;
+	else if(arena->nextsize<ARENA_MAX_CHUNK)arena->nextsize*=2;
+	chunk=(arena_chunk_t*)malloc(sizeof(arena_chunk_t)+csize,char);
+	if(!chunk)outofmem();
+	chunk->size=csize;
+	chunk->used=size;
+	if(arena->chunks&&csize==size){
+		// A dedicated chunk; keep allocating from the current one
+		chunk->next=arena->chunks->next;
+		arena->chunks->next=chunk;
+	} else {
+		chunk->next=arena->chunks;
+		arena->chunks=chunk;
+	}
+	return chunk->data;
+}
+
+// frees everything but keeps the largest chunk around for reuse
+static void arena_reset(arena_t *arena){
+	arena_chunk_t *keep=arena->chunks;
+	if(!keep)return;
+	for(arena_chunk_t *c=keep->next;c;c=c->next)if(c->size>keep->size)keep=c;
+	while(arena->chunks){
+		arena_chunk_t *next=arena->chunks->next;
+		if(arena->chunks!=keep)free(arena->chunks);
+		arena->chunks=next;
+	}
+	keep->next=NULL;
+	keep->used=0;
+	arena->chunks=keep;
+}
+
+static void arena_destroy(arena_t *arena){
+	while(arena->chunks){
+		arena_chunk_t *next=arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks=next;
+	}
+}
+
+// Fixed-size object pool with a free list, backed by an arena
+typedef struct pool_t{
+	size_t objsize;
+	void *freelist;
+	arena_t arena;
+} pool_t;
+
+static void pool_init(pool_t *pool,size_t objsize){
+	pool->objsize=objsize<sizeof(void*)?sizeof(void*):objsize;
+	pool->freelist=NULL;
+	arena_init(&pool->arena);
+}
+
+static void* pool_alloc(pool_t *pool){
+	void *p=pool->freelist;
+	if(!p)return arena_alloc(&pool->arena,pool->objsize);
+	pool->freelist=*(void**)p;
+	return p;
+}
+
+static void pool_free(pool_t *pool,void *p){
+	*(void**)p=pool->freelist;
+	pool->freelist=p;
+}
+
+static void pool_destroy(pool_t *pool){
+	arena_destroy(&pool->arena);
+}
+
+
+// Printed output is collected per program and handed to the sink in batches:
+// when the buffer fills up, on 'flush', before reading input or calling a C
+// function, and when control returns to the host.
+#define OUTBUF_SIZE 65536
+
+typedef struct outbuf_t{
+	char *buf; // OUTBUF_SIZE bytes
+	int len;
+	postl_output_func_t sink;
+	void *ctx;
+} outbuf_t;
+
+static void sink_file(void *ctx,const char *data,int len){
+	FILE *f=(FILE*)ctx;
+	fwrite(data,1,len,f);
+	fflush(f);
+}
+
+static void sink_fd(void *ctx,const char *data,int len){
+	int fd=(int)(intptr_t)ctx;
+	while(len>0){
+		ssize_t n=write(fd,data,len);
+		if(n<0&&errno==EINTR)continue;
+		if(n<=0)return;
+		data+=n; len-=n;
+	}
+}
+
+static void out_init(outbuf_t *out){
+	out->buf=malloc(OUTBUF_SIZE,char);
+	if(!out->buf)outofmem();
+	out->len=0;
+	out->sink=NULL;
+	out->ctx=NULL;
+}
+
+static void out_flush(outbuf_t *out){
+	if(out->len==0)return;
+	if(out->sink)out->sink(out->ctx,out->buf,out->len);
+	else sink_file(stdout,out->buf,out->len);
+	out->len=0;
+}
+
+static void out_write(outbuf_t *out,const char *data,int len){
+	if(out->len+len>OUTBUF_SIZE){
+		out_flush(out);
+		if(len>OUTBUF_SIZE){
+			if(out->sink)out->sink(out->ctx,data,len);
+			else sink_file(stdout,data,len);
+			return;
+		}
+	}
+	memcpy(out->buf+out->len,data,len);
+	out->len+=len;
+}
+
+static void out_char(outbuf_t *out,char c){
+	if(out->len==OUTBUF_SIZE)out_flush(out);
+	out->buf[out->len++]=c;
+}
+
+static void out_str(outbuf_t *out,const char *str){
+	out_write(out,str,strlen(str));
+}
+
+// Same output as printf("%g"), but integers up to six digits, which is what
+// scripts mostly print, are formatted without going through printf
+static void out_num(outbuf_t *out,double num){
+	char buf[32];
+	int len;
+	if(num>-1e6&&num<1e6&&num==(int)num&&!(num==0&&signbit(num))){
+		int n=num<0?-(int)num:(int)num;
+		char *p=buf+sizeof(buf);
+		do *--p='0'+n%10; while((n/=10)>0);
+		if(num<0)*--p='-';
+		len=buf+sizeof(buf)-p;
+		out_write(out,p,len);
+		return;
+	}
+	len=snprintf(buf,sizeof(buf),"%g",num);
+	out_write(out,buf,len);
+}
+
+
+// Input is read from the source into a per-program buffer, which grows when a
+// single line or token doesn't fit. The output buffer is flushed before the
+// source is asked for more, so prompts appear before the program waits.
+#define INBUF_SIZE 65536
+#define INBUF_MAX (1<<30) // the buffer doesn't grow beyond this
+
+typedef struct inbuf_t{
+	char *buf;
+	int pos,len,cap; // the unread input is buf[pos..len)
+	bool eof;
+	bool full; // the last fill failed because the buffer was at INBUF_MAX
+	postl_input_func_t source;
+	void *ctx;
+	outbuf_t *tied; // flushed before reading more
+} inbuf_t;
+
+// A line at a time, so that interactive input isn't held up
+static int source_file(void *ctx,char *buf,int size){
+	FILE *f=(FILE*)ctx;
+	int n=0,c;
+	flockfile(f);
+	while(n<size&&(c=getc_unlocked(f))!=EOF){
+		buf[n++]=c;
+		if(c=='\n')break;
+	}
+	funlockfile(f);
+	return n;
+}
+
+static int source_fd(void *ctx,char *buf,int size){
+	int fd=(int)(intptr_t)ctx;
+	ssize_t n;
+	do n=read(fd,buf,size); while(n<0&&errno==EINTR);
+	return n<0?0:n;
+}
+
+static void in_init(inbuf_t *in,outbuf_t *tied){
+	in->cap=INBUF_SIZE;
+	in->buf=malloc(in->cap,char);
+	if(!in->buf)outofmem();
+	in->pos=in->len=0;
+	in->eof=false;
+	in->full=false;
+	in->source=NULL;
+	in->ctx=NULL;
+	in->tied=tied;
+}
+
+// Appends more input to the unread part; returns false at end of input, or
+// with in->full set if the unread part is too long to add to
+static bool in_fill(inbuf_t *in){
+	in->full=false;
+	if(in->eof)return false;
+	if(in->pos>0){
+		memmove(in->buf,in->buf+in->pos,in->len-in->pos);
+		in->len-=in->pos;
+		in->pos=0;
+	}
+	if(in->len==in->cap){
+		if(in->cap>=INBUF_MAX){
+			in->full=true;
+			return false;
+		}
+		in->cap*=2;
+		in->buf=realloc(in->buf,in->cap,char);
+		if(!in->buf)outofmem();
+	}
+	if(in->tied)out_flush(in->tied);
+	int n;
+	if(in->source)n=in->source(in->ctx,in->buf+in->len,in->cap-in->len);
+	else n=source_file(stdin,in->buf+in->len,in->cap-in->len);
+	if(n<=0){
+		in->eof=true;
+		return false;
+	}
+	in->len+=n;
+	return true;
+}
+
+// Makes sure at least n bytes are unread, if the input has that many; returns
+// the number of unread bytes
+static int in_want(inbuf_t *in,int n){
+	while(in->len-in->pos<n&&in_fill(in));
+	return in->len-in->pos;
+}
+
+// FNV-1a
+static unsigned int namehash(const char *name,int len){
+	unsigned int h=2166136261u;
+	for(int i=0;i<len;i++){
+		h^=(unsigned char)name[i];
+		h*=16777619u;
+	}
+	return h;
 }
 
 static const char* valtype_string(postl_valtype_t type){
@@ -52,18 +328,22 @@ static double floatmod(double a,double b){
 	return sa*(a-b*floor(a/b));
 }
 
-static void pprintstr(const char *str){
-	putchar('"');
-	for(const char *p=str;*p;p++){
-		if(*p=='\n')printf("\\n");
-		else if(*p=='\r')printf("\\r");
-		else if(*p=='\t')printf("\\t");
-		else if(*p=='\\')printf("\\\\");
-		else if(*p=='"')printf("\\\"");
-		else if(*p<32||*p>126)printf("\\x%02X",*p);
-		else putchar(*p);
+static void pprintstr(outbuf_t *out,const char *str,int len){
+	out_char(out,'"');
+	for(const char *p=str;p<str+len;p++){
+		if(*p=='\n')out_str(out,"\\n");
+		else if(*p=='\r')out_str(out,"\\r");
+		else if(*p=='\t')out_str(out,"\\t");
+		else if(*p=='\\')out_str(out,"\\\\");
+		else if(*p=='"')out_str(out,"\\\"");
+		else if(*p<32||*p>126){
+			char buf[16];
+			snprintf(buf,sizeof(buf),"\\x%02X",*p);
+			out_str(out,buf);
+		}
+		else out_char(out,*p);
 	}
-	putchar('"');
+	out_char(out,'"');
 }
 
 
@@ -75,172 +355,662 @@ typedef enum tokentype_t{
 	TT_SYMBOL
 } tokentype_t;
 
+// Tokens point into the source; only string literals with escapes in them get
+// their own decoded copy, in the program's scratch arena.
 typedef struct token_t{
 	tokentype_t type;
-	char *str;
+	const char *str; // not NUL-terminated
+	int len;
+	union {
+		double numv; // for TT_NUM
+		int match;   // for '{': index of the matching '}'
+	};
 } token_t;
 
+enum {
+	CC_SPACE=1,
+	CC_DIGIT=2,
+	CC_ALPHA=4,   // letters and '_'
+	CC_NUMCHAR=8, // characters strtod might consume after the first
+};
+
+static const unsigned char charclass[256]={
+	[' ']=CC_SPACE, ['\t']=CC_SPACE, ['\n']=CC_SPACE, ['\r']=CC_SPACE,
+	['0' ... '9']=CC_DIGIT|CC_NUMCHAR,
+	['a' ... 'z']=CC_ALPHA|CC_NUMCHAR,
+	['A' ... 'Z']=CC_ALPHA|CC_NUMCHAR,
+	['_']=CC_ALPHA,
+	['.']=CC_NUMCHAR, ['+']=CC_NUMCHAR, ['-']=CC_NUMCHAR,
+};
+
+#define CHARCLASS(c) (charclass[(unsigned char)(c)])
+
+typedef enum builtin_enum_t{
+#define BUILTIN(e,n) BI_##e,
+#include "builtins.def"
+#undef BUILTIN
+	NUM_BUILTINS
+} builtin_enum_t;
+
+static const char *builtin_names[NUM_BUILTINS]={
+#define BUILTIN(e,n) [BI_##e]=n,
+#include "builtins.def"
+#undef BUILTIN
+};
+
+#include "builtins_phash.h"
+
+// returns -1 if not a builtin; hash is namehash(name,len)
+static int builtin_find(const char *name,int len,unsigned int hash){
+	int bi=builtin_phash[(unsigned int)(hash*BUILTIN_PHASH_MULT)>>(32-BUILTIN_PHASH_BITS)];
+	if(bi!=-1&&builtin_lens[bi]==len&&memcmp(builtin_names[bi],name,len)==0)return bi;
+	return -1;
+}
+
+
+// Every name is interned once into its program's symbol table, and referred to
+// by its index (symbol ID) everywhere else. The first NUM_BUILTINS symbols are
+// the builtins, so the symbol ID of a builtin's name is its builtin_enum_t in
+// every program; those are found through builtin_phash instead of the index.
+// Nothing here is shared between programs.
+typedef struct symbol_t{
+	const char *name; // static for builtins
+	int len;
+	unsigned int hash;
+	bool cfunc; // whether a C function was ever registered under this name
+} symbol_t;
+
+typedef struct symtab_t{
+	symbol_t *syms;
+	int nsyms,cap;
+	int nfrozen; // the names of symbols below this aren't owned by the table
+	int *index; // open addressing; symbol ID or -1; size is a power of two
+	int indexsz;
+} symtab_t;
+
+static void symindex_insert(symtab_t *st,int sym){
+	int mask=st->indexsz-1;
+	int i=st->syms[sym].hash&mask;
+	while(st->index[i]!=-1)i=(i+1)&mask;
+	st->index[i]=sym;
+}
+
+// returns -1 if not interned
+static int symbol_find_n(const symtab_t *st,const char *name,int len,unsigned int hash){
+	int bi=builtin_find(name,len,hash);
+	if(bi!=-1)return bi;
+	int mask=st->indexsz-1;
+	for(int i=hash&mask;st->index[i]!=-1;i=(i+1)&mask){
+		const symbol_t *sy=&st->syms[st->index[i]];
+		if(sy->hash==hash&&sy->len==len&&memcmp(sy->name,name,len)==0)return st->index[i];
+	}
+	return -1;
+}
+
+static int symbol_find(const symtab_t *st,const char *name){
+	int len=strlen(name);
+	return symbol_find_n(st,name,len,namehash(name,len));
+}
+
+static int symbol_intern_n(symtab_t *st,const char *name,int len){
+	unsigned int hash=namehash(name,len);
+	int sym=symbol_find_n(st,name,len,hash);
+	if(sym!=-1)return sym;
+
+	if(st->nsyms==st->cap){
+		st->cap*=2;
+		st->syms=realloc(st->syms,st->cap,symbol_t);
+		if(!st->syms)outofmem();
+	}
+	sym=st->nsyms++;
+	char *copy=malloc(len+1,char);
+	if(!copy)outofmem();
+	memcpy(copy,name,len);
+	copy[len]='\0';
+	st->syms[sym].name=copy;
+	st->syms[sym].len=len;
+	st->syms[sym].hash=hash;
+	st->syms[sym].cfunc=false;
+
+	if(2*(st->nsyms-NUM_BUILTINS)>st->indexsz){ // keep the load factor at most 1/2
+		free(st->index);
+		st->indexsz*=2;
+		st->index=malloc(st->indexsz,int);
+		if(!st->index)outofmem();
+		for(int i=0;i<st->indexsz;i++)st->index[i]=-1;
+		for(int i=NUM_BUILTINS;i<st->nsyms;i++)symindex_insert(st,i);
+	} else symindex_insert(st,sym);
+	return sym;
+}
+
+static int symbol_intern(symtab_t *st,const char *name){
+	return symbol_intern_n(st,name,strlen(name));
+}
+
+static const char* symbol_name(const symtab_t *st,int sym){
+	return st->syms[sym].name;
+}
+
+static void symtab_init(symtab_t *st){
+	st->cap=128;
+	st->nsyms=0;
+	st->syms=malloc(st->cap,symbol_t);
+	if(!st->syms)outofmem();
+	st->indexsz=256;
+	st->index=malloc(st->indexsz,int);
+	if(!st->index)outofmem();
+	for(int i=0;i<st->indexsz;i++)st->index[i]=-1;
+	for(int i=0;i<NUM_BUILTINS;i++){
+		st->syms[i].name=builtin_names[i];
+		st->syms[i].len=builtin_lens[i];
+		st->syms[i].hash=builtin_hashes[i];
+		st->syms[i].cfunc=false;
+	}
+	st->nsyms=st->nfrozen=NUM_BUILTINS;
+}
+
+static void symtab_destroy(symtab_t *st){
+	for(int i=st->nfrozen;i<st->nsyms;i++)free((char*)st->syms[i].name);
+	free(st->syms);
+	free(st->index);
+}
+
+
+// Strings know their length, so they may contain NULs and aren't
+// NUL-terminated. They're refcounted and immutable while shared; a string with
+// a single reference may be appended to in place. A slice shares the data of
+// the string it was taken from, which it keeps alive.
+// A frozen string (refcount -1) belongs to a snapshot and may be shared between
+// programs on different threads; it isn't refcounted and never changes.
+// Appending to a string that ends where its buffer's used part ends writes
+// into the spare capacity and returns a slice of the same buffer, even if the
+// string is shared: the other holders never look past their own length. This
+// makes "s x + \"s\" def" in a loop linear, like a string builder.
+typedef struct str_t{
+	int refcount,len;
+	int cap; // size of buf; 0 for a slice
+	int used; // bytes at the start of buf that some string may refer to
+	struct str_t *base; // for a slice, the string that owns data; NULL otherwise
+	char *data; // buf, or part of base's buf
+	char buf[];
+} str_t;
+
+static str_t* str_alloc(int cap){
+	str_t *str=(str_t*)malloc(sizeof(str_t)+cap,char);
+	if(!str)outofmem();
+	str->refcount=1;
+	str->len=0;
+	str->cap=cap;
+	str->used=0;
+	str->base=NULL;
+	str->data=str->buf;
+	return str;
+}
+
+static str_t* str_make(const char *data,int len){
+	str_t *str=str_alloc(len);
+	memcpy(str->data,data,len);
+	str->len=str->used=len;
+	return str;
+}
+
+static str_t* str_retain(str_t *str){
+	if(str->refcount>=0)str->refcount++;
+	return str;
+}
+
+static void str_release(str_t *str){
+	if(str->refcount<0||--str->refcount>0)return;
+	if(str->base)str_release(str->base);
+	free(str);
+}
+
+static str_t* str_slice(str_t *str,int start,int len){
+	str_t *base=str->base?str->base:str;
+	str_t *slice=str_alloc(0);
+	slice->base=str_retain(base);
+	slice->data=str->data+start;
+	slice->len=len;
+	return slice;
+}
+
+// Takes over the reference to str, and returns str with data appended; that's
+// str itself if nothing else refers to it
+static str_t* str_append(str_t *str,const char *data,int len){
+	if(str->refcount==1&&!str->base){
+		if(str->len+len>str->cap){
+			int cap=2*(str->len+len);
+			str=(str_t*)realloc(str,sizeof(str_t)+cap,char);
+			if(!str)outofmem();
+			str->cap=cap;
+			str->data=str->buf;
+		}
+		memcpy(str->data+str->len,data,len);
+		str->len+=len;
+		str->used=str->len;
+		return str;
+	}
+	str_t *base=str->base?str->base:str;
+	int end=str->data+str->len-base->buf;
+	// a slice that's the only reference to its base owns everything after it
+	if(str->refcount==1&&base->refcount==1)base->used=end;
+	if(end==base->used&&base->used+len<=base->cap&&base->refcount>=0){
+		memcpy(base->buf+base->used,data,len);
+		base->used+=len;
+		str_t *res=str_slice(str,0,str->len+len);
+		str_release(str);
+		return res;
+	}
+	str_t *res=str_alloc(2*(str->len+len));
+	memcpy(res->data,str->data,str->len);
+	memcpy(res->data+str->len,data,len);
+	res->len=res->used=str->len+len;
+	str_release(str);
+	return res;
+}
+
+static int str_compare(const str_t *a,const str_t *b){
+	int c=memcmp(a->data,b->data,a->len<b->len?a->len:b->len);
+	if(c!=0)return c;
+	return (a->len>b->len)-(a->len<b->len);
+}
+
+// returns a malloc'ed NUL-terminated copy
+static char* str_cstr(const str_t *str){
+	char *cstr=malloc(str->len+1,char);
+	if(!cstr)outofmem();
+	memcpy(cstr,str->data,str->len);
+	cstr[str->len]='\0';
+	return cstr;
+}
+
+
+// Token lists are compiled to instructions before they're run, so that
+// numbers are parsed, builtins are resolved and '{' ... '}' are turned into
+// block literals only once.
+typedef enum opcode_t{
+	OP_NUM,     // push numv
+	OP_STR,     // push str
+	OP_BLOCK,   // push blockv
+	OP_PPC,     // preprocessor command str
+	OP_CALL,    // call user function sym
+	OP_BUILTIN, // execute builtin sym, unless a user function shadows it
+	// Like OP_BUILTIN, but with the common case handled inline by the dispatch loop
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+	OP_EQ, OP_GT, OP_LT,
+	OP_DUP, OP_SWAP, OP_POP,
+	// Superinstructions: only ever an xop, covering this and the next instructions
+	OP_ADDK, OP_SUBK, OP_MULK, OP_DIVK, // OP_NUM, then the arithmetic op
+	OP_EQK, OP_GTK, OP_LTK,             // OP_NUM, then the comparison
+	OP_DUPEQK, OP_DUPGTK, OP_DUPLTK,    // OP_DUP, OP_NUM, then the comparison
+	OP_IFBLOCK, OP_WHILEBLOCK,          // OP_BLOCK, then 'if' or 'while'
+	OP_IFELSEBLOCKS,                    // OP_BLOCK, OP_BLOCK, then 'ifelse'
+	NUM_OPS
+} opcode_t;
+
+#define OP_HAS_SYM(op) ((op)>=OP_CALL)
+
+// Instructions keep the op they were compiled to, for printing and profiling;
+// the dispatch loop runs xop, which is either op or a superinstruction that
+// starts here. Superinstructions fall back to running op when their fast path
+// doesn't apply, after which the instructions they cover run as usual.
+typedef struct instr_t{
+	opcode_t op,xop;
+	char *str; // source text of the token (string contents for OP_STR); NULL for
+	           // OP_BLOCK and ops with a sym
+	union {
+		double numv;
+		int sym;
+		struct code_t *blockv;
+		str_t *strv; // for OP_STR
+	};
+} instr_t;
+
+// All code compiled in one go lives in the arena of one compilation unit,
+// which is freed when the last reference to any of its code is released. Like
+// strings, units can be frozen.
+typedef struct codeunit_t{
+	int refcount; // -1 if frozen
+	arena_t arena;
+	str_t **strs; // the string literals, which live outside the arena
+	int nstrs,strscap;
+} codeunit_t;
+
+// Code is immutable once compiled, and shared between everything that refers
+// to it (stack values, function definitions, enclosing code).
 typedef struct code_t{
-	int sz,len;
-	token_t *tokens; // NULL iff sz==0
+	codeunit_t *unit;
+	bool scoped; // whether running it opens a scope; false for blocks that can't def anything
+	bool block; // false for the top level of compiled source
+	int len;
+	instr_t *instrs; // NULL iff len==0
 } code_t;
 
 
-typedef struct stackitem_t{
-	postl_stackval_t val;
-	struct stackitem_t *next;
-} stackitem_t;
-
+// Values are kept in this form internally: half the size of the public
+// postl_stackval_t, which has a field for every type. A value owns its string
+// and holds a reference to its block.
+typedef struct value_t{
+	postl_valtype_t type;
+	union {
+		double numv;
+		str_t *strv;
+		code_t *blockv;
+	};
+} value_t;
 
 typedef struct funcmap_item_t{
-	char *name;
+	int sym;
 	void (*cfunc)(postl_program_t*); // NULL if not applicable
-	code_t code; // sz==0 if not applicable
+	code_t *code; // NULL if not applicable
+	// Variables live in the function map too, so that they're scoped and
+	// shadowed exactly like functions
+	bool isvar;
+	value_t val; // number or string; only if isvar
 } funcmap_item_t;
 
 typedef struct funcmap_llitem_t{
 	funcmap_item_t item;
-	struct funcmap_llitem_t *next;
+	int scope; // index in the scope stack of the scope that will delete this item, or -1
+	bool frozen; // if so, it's in a frozen set instead of the program's pool, and immutable
+	struct funcmap_llitem_t *next; // the item this one shadows
 } funcmap_llitem_t;
 
-
-/*typedef struct var_item_t{
-	char *name;
-	postl_stackval_t val;
-} var_item_t;
-
-typedef struct var_llitem_t{
-	var_item_t item;
-	struct var_llitem_t *next;
-} var_llitem_t;*/
-
-
-typedef struct name_llitem_t{
-	char *name;
-	struct name_llitem_t *next;
-} name_llitem_t;
-
-typedef struct scope_frame_t{
-	name_llitem_t *vars[HASHMAP_SIZE];
-	struct scope_frame_t *next;
-} scope_frame_t;
-
+// The function map is an open-addressing hash table on symbol ID. Every slot
+// holds the stack of items bound to its symbol: the same function might
+// appear multiple times in it, meaning it appears in multiple stacked scopes
+// (the first appearance is always active). Slots are never removed, only
+// their binding stack emptied, so no tombstones are needed.
+typedef struct funcmap_slot_t{
+	int sym; // -1 if empty
+	funcmap_llitem_t *bindings; // NULL if sym is currently unbound
+} funcmap_slot_t;
+
+
+// A run is checked against its limits when the fuel runs out, which happens
+// at least every BUDGET_SLICE instructions. Fuel is only taken when a block
+// starts or goes round a loop, since a block runs straight through otherwise;
+// code longer than BUDGET_SLICE is run in segments that each take fuel.
+#define BUDGET_SLICE (16384)
+
+typedef struct budget_t{
+	long fuel,given; // left before the next check, and given at the last one
+	long used,max; // instructions run in this run, and the limit; 0 means none
+	double seconds,deadline; // time limit per run, and when this run must stop; 0 means none
+	bool interrupted; // set from any thread
+} budget_t;
+
+#ifdef POSTL_PROFILE
+#define PROFILE_MAXN (3)
+
+// How often each instruction n-gram (2<=n<=PROFILE_MAXN) that ends at
+// instruction idx of code was executed
+typedef struct profile_entry_t{
+	code_t *code; // retained; NULL if the slot is empty
+	int idx,n;
+	long count;
+} profile_entry_t;
+
+typedef struct profile_t{
+	profile_entry_t *entries; // open addressing
+	int sz,used; // sz is a power of two
+	long ninstrs;
+} profile_t;
+#endif
 
 struct postl_program_t{
-	stackitem_t *stack;
-	int stacksz;
-	funcmap_llitem_t *fmap[HASHMAP_SIZE]; // the same function might appear multiple times after another,
-	                                      // meaning it appears in multiple stacked scopes (the first
-	                                      // appearance is always active)
-	//var_llitem_t *vmap[HASHMAP_SIZE];
-	code_t *buildblock; // !NULL iff collecting tokens in a { block }
-	int blockdepth;
-	scope_frame_t *scopestack;
+	value_t *stack; // bottom at index 0, top at stacksz-1
+	int stacksz,stackcap;
+	funcmap_slot_t *fmap;
+	int fmapsz,fmapused; // fmapsz is a power of two
+	int builtinbound[NUM_BUILTINS]; // number of bindings shadowing each builtin
+	pool_t fmappool; // funcmap_llitem_t's
+	arena_t scratch; // tokens while compiling
+	symtab_t syms;
+	char errbuf[256]; // returned error strings that had to be formatted
+	outbuf_t out;
+	inbuf_t in;
+	str_t *chars[256]; // single-character strings, made when first needed
+#ifdef POSTL_PROFILE
+	profile_t profile;
+#endif
+	int *scopelog; // symbols def'd in the open scopes, in order; undone by scopeleave
+	int scopeloglen,scopelogcap;
+	int *scopestack; // for each open scope, the scopelog length when it was entered
+	int nscopes,scopestackcap;
+	struct frozen_t *frozen; // the objects this program shares with snapshots; NULL if none
+	struct frame_t *frames; // the blocks running, innermost last
+	int nframes,framescap;
+	int running; // nesting depth of calls into the dispatch loop
+	budget_t budget;
+	const char *error; // the error or preemption reason from the last run
+	bool suspend; // set by a C function to suspend the code that called it
+	void *userdata;
 };
 
 
-static bool istruthy(postl_stackval_t val){
+static void reverse_stackvals(value_t *vals,int n){
+	for(int i=0,j=n-1;i<j;i++,j--){
+		value_t tmp=vals[i];
+		vals[i]=vals[j];
+		vals[j]=tmp;
+	}
+}
+
+static bool istruthy(value_t val){
 	switch(val.type){
 		case POSTL_NUM: return val.numv!=0; break;
-		case POSTL_STR: return val.strv[0]!='\0'; break;
+		case POSTL_STR: return val.strv->len>0; break;
 		case POSTL_BLOCK: return true; break;
 		default: assert(false);
 	}
 }
 
 
-static void printstackval(postl_stackval_t val,bool pretty){
+// Single-character strings are shared, so that getc and friends don't
+// allocate
+static str_t* char_str(postl_program_t *prog,unsigned char c){
+	if(!prog->chars[c])prog->chars[c]=str_make((const char*)&c,1);
+	return str_retain(prog->chars[c]);
+}
+
+
+// Every block is printed with the scope it has in the language, whether or not
+// that was optimised away
+static void printcode(outbuf_t *out,const symtab_t *st,const code_t *code){
+	out_str(out,"{ scopeenter ");
+	for(int i=0;i<code->len;i++){
+		const instr_t *in=&code->instrs[i];
+		if(in->op==OP_STR)pprintstr(out,in->strv->data,in->strv->len);
+		else if(in->op==OP_BLOCK)printcode(out,st,in->blockv);
+		else if(OP_HAS_SYM(in->op))out_str(out,symbol_name(st,in->sym));
+		else out_str(out,in->str);
+		out_char(out,' ');
+	}
+	out_str(out,"scopeleave }");
+}
+
+static codeunit_t* codeunit_make(void){
+	codeunit_t *unit=malloc(1,codeunit_t);
+	if(!unit)outofmem();
+	unit->refcount=1;
+	arena_init(&unit->arena);
+	unit->strs=NULL;
+	unit->nstrs=unit->strscap=0;
+	return unit;
+}
+
+// takes over the reference to str
+static void codeunit_addstr(codeunit_t *unit,str_t *str){
+	if(unit->nstrs==unit->strscap){
+		unit->strscap=unit->strscap==0?16:2*unit->strscap;
+		unit->strs=realloc(unit->strs,unit->strscap,str_t*);
+		if(!unit->strs)outofmem();
+	}
+	unit->strs[unit->nstrs++]=str;
+}
+
+static void codeunit_release(codeunit_t *unit){
+	if(unit->refcount<0||--unit->refcount>0)return;
+	for(int i=0;i<unit->nstrs;i++)str_release(unit->strs[i]);
+	free(unit->strs);
+	arena_destroy(&unit->arena);
+	free(unit);
+}
+
+static code_t* code_retain(code_t *code){
+	if(code->unit->refcount>=0)code->unit->refcount++;
+	return code;
+}
+
+static void code_release(code_t *code){
+	codeunit_release(code->unit);
+}
+
+
+static value_t value_num(double num){
+	value_t val={.type=POSTL_NUM,.numv=num};
+	return val;
+}
+
+static value_t value_str(str_t *str){
+	value_t val={.type=POSTL_STR,.strv=str};
+	return val;
+}
+
+static value_t value_copy(value_t val){
+	if(val.type==POSTL_STR)str_retain(val.strv);
+	else if(val.type==POSTL_BLOCK)code_retain(val.blockv);
+	return val;
+}
+
+static void value_release(value_t val){
+	if(val.type==POSTL_STR)str_release(val.strv);
+	else if(val.type==POSTL_BLOCK)code_release(val.blockv);
+}
+
+// takes over the value
+static void stack_push(postl_program_t *prog,value_t val){
+	if(prog->stacksz==prog->stackcap){
+		prog->stackcap*=2;
+		prog->stack=realloc(prog->stack,prog->stackcap,value_t);
+		if(!prog->stack)outofmem();
+	}
+	prog->stack[prog->stacksz++]=val;
+}
+
+static value_t stack_pop(postl_program_t *prog){
+	if(prog->stacksz==0){
+		fprintf(stderr,"postl: Stack pop on empty stack!\n");
+		exit(1);
+	}
+	return prog->stack[--prog->stacksz];
+}
+
+
+static void printstackval(postl_program_t *prog,value_t val,bool pretty){
 	switch(val.type){
 		case POSTL_NUM:
-			printf("%g",val.numv);
+			out_num(&prog->out,val.numv);
 			break;
 		case POSTL_STR:
-			if(pretty)pprintstr(val.strv);
-			else printf("%s",val.strv);
+			if(pretty)pprintstr(&prog->out,val.strv->data,val.strv->len);
+			else out_write(&prog->out,val.strv->data,val.strv->len);
 			break;
-		case POSTL_BLOCK:{
-			token_t *tokens=val.blockv->tokens;
-			printf("{ ");
-			for(int i=0;i<val.blockv->len;i++){
-				if(tokens[i].type==TT_STR)pprintstr(tokens[i].str);
-				else printf("%s",tokens[i].str);
-				putchar(' ');
-			}
-			putchar('}');
+		case POSTL_BLOCK:
+			printcode(&prog->out,&prog->syms,val.blockv);
 			break;
-		}
 	}
-	fflush(stdout);
 }
 
 
 static void funcmap_item_release(funcmap_item_t item){
-	free(item.name);
-	if(item.code.sz!=0){
-		token_t *tokens=item.code.tokens;
-		for(int i=0;i<item.code.len;i++){
-			free(tokens[i].str);
-		}
-		free(tokens);
-	}
+	if(item.code)code_release(item.code);
+	if(item.isvar)value_release(item.val);
 }
 
 
 //maybe returns error string
-static const char* tokenise(token_t **tokensp,const char *source,int *ntokens){
-	static char errbuf[256];
+// The token list is malloc'ed, since it's grown by realloc, which for large
+// scripts can extend it without copying. Decoded strings are allocated in the
+// program's scratch arena; other tokens point into the source.
+static const char* tokenise(postl_program_t *prog,token_t **tokensp,const char *source,int sourcelen,
+		int *ntokens){
 	*tokensp=NULL; // precaution
-	int sourcelen=strlen(source);
 	int sz=128,len=0;
 	token_t *tokens=malloc(sz,token_t);
 	if(!tokens)outofmem();
 
 	int blockdepth=0;
+	int openbrace=-1; // innermost unclosed '{'; its match field links to the one outside it
 
 #define DESTROY_TOKENS_RETF(...) \
 		do { \
-			for(int i=0;i<len;i++)free(tokens[i].str); \
 			free(tokens); \
-			snprintf(errbuf,256,__VA_ARGS__); \
-			return errbuf; \
+			snprintf(prog->errbuf,sizeof(prog->errbuf),__VA_ARGS__); \
+			return prog->errbuf; \
+		} while(0)
+
+#define ADD_TOKEN(type_,str_,len_) \
+		do { \
+			if(len==sz){ \
+				sz*=2; \
+				tokens=realloc(tokens,sz,token_t); \
+				if(!tokens)outofmem(); \
+			} \
+			tokens[len].type=(type_); \
+			tokens[len].str=(str_); \
+			tokens[len].len=(len_); \
+			len++; \
 		} while(0)
 
 	for(int i=0;i<sourcelen;i++){
-		if(strchr(" \t\n\r",source[i])!=NULL){
+		unsigned char cc=CHARCLASS(source[i]);
+		if(cc&CC_SPACE){
 			//whitespace; pass
 		} else if(source[i]=='#'){ // comment
 			i++;
 			while(i<sourcelen&&source[i]!='\n')i++;
-		} else if(isdigit(source[i])||(i<sourcelen-1&&source[i]=='-'&&isdigit(source[i+1]))){
+		} else if((cc&CC_DIGIT)||(i<sourcelen-1&&source[i]=='-'&&(CHARCLASS(source[i+1])&CC_DIGIT))){
+			// strtod never reads beyond this run, so parse a NUL-terminated copy of it
+			int j;
+			for(j=i+1;j<sourcelen&&(CHARCLASS(source[j])&CC_NUMCHAR);j++);
+			char numbuf[64],*buf=numbuf;
+			if(j-i>=(int)sizeof(numbuf)&&(buf=malloc(j-i+1,char))==NULL)outofmem();
+			memcpy(buf,source+i,j-i);
+			buf[j-i]='\0';
 			char *endp;
-			double nval=strtod(source+i,&endp);
-			int numlen=endp-(source+i);
+			double nval=strtod(buf,&endp);
+			int numlen=endp-buf;
+			if(buf!=numbuf)free(buf);
 			if(isnan(nval)||isinf(nval)||numlen<=0)
 				DESTROY_TOKENS_RETF("postl: Invalid number in source");
 
-			if(len==sz&&(sz*=2,tokens=realloc(tokens,sz,token_t))==NULL)outofmem();
-			tokens[len].type=TT_NUM;
-			tokens[len].str=malloc(numlen+1,char);
-			if(!tokens[len].str)outofmem();
-			memcpy(tokens[len].str,source+i,numlen);
-			tokens[len].str[numlen]='\0';
-			len++;
+			ADD_TOKEN(TT_NUM,source+i,numlen);
+			tokens[len-1].numv=nval;
 			i+=numlen-1;
 		} else if(source[i]=='"'){
 			i++;
 			int j,slen=0;
+			bool escaped=false;
 			for(j=i;j<sourcelen;j++){
 				if(source[j]=='"')break;
-				if(source[j]=='\\')j++;
+				if(source[j]=='\\'){
+					escaped=true;
+					j++;
+				}
 				slen++;
 			}
-			if(j==sourcelen)
+			if(j>=sourcelen)
 				DESTROY_TOKENS_RETF("postl: Unclosed string (from char %d) in source file",i-1);
 
-			if(len==sz&&(sz*=2,tokens=realloc(tokens,sz,token_t))==NULL)outofmem();
-			tokens[len].type=TT_STR;
-			tokens[len].str=malloc(slen+1,char);
-			if(!tokens[len].str)outofmem();
+			if(!escaped){
+				ADD_TOKEN(TT_STR,source+i,slen);
+				i=j;
+				continue;
+			}
+
+			char *str=arena_alloc(&prog->scratch,slen+1);
 			int k=0;
 			for(j=i;;j++){
 				if(source[j]=='"')break;
@@ -257,47 +1027,40 @@ static const char* tokenise(token_t **tokensp,const char *source,int *ntokens){
 						// TODO: \unnnn and \Unnnnnnnn
 						// purposefully skipped: \f and \v
 					}
-					tokens[len].str[k++]=c;
-				} else tokens[len].str[k++]=source[j];
+					str[k++]=c;
+				} else str[k++]=source[j];
 			}
-			tokens[len].str[k]='\0';
-			len++;
+			str[k]='\0';
+			ADD_TOKEN(TT_STR,str,k);
 			i=j;
-		} else if(isalpha(source[i])||source[i]=='_'||source[i]=='@'){
+		} else if((cc&CC_ALPHA)||source[i]=='@'){
 			bool isppc=source[i]=='@';
 			if(isppc){
 				i++;
-				if(i==sourcelen||(!isalpha(source[i])&&source[i]!='_'&&!isdigit(source[i])))
+				if(i==sourcelen||!(CHARCLASS(source[i])&(CC_ALPHA|CC_DIGIT)))
 					DESTROY_TOKENS_RETF("postl: '@' not followed by PPC token");
 			}
 			int j;
 			for(j=i+1;j<sourcelen;j++){
-				if(!isalpha(source[j])&&source[j]!='_'&&!isdigit(source[j]))break;
+				if(!(CHARCLASS(source[j])&(CC_ALPHA|CC_DIGIT)))break;
 			}
-			int wordlen=j-i;
-
-			if(len==sz&&(sz*=2,tokens=realloc(tokens,sz,token_t))==NULL)outofmem();
-			tokens[len].type=isppc?TT_PPC:TT_WORD;
-			tokens[len].str=malloc(wordlen+1,char);
-			if(!tokens[len].str)outofmem();
-			memcpy(tokens[len].str,source+i,wordlen);
-			tokens[len].str[wordlen]='\0';
-			len++;
+			ADD_TOKEN(isppc?TT_PPC:TT_WORD,source+i,j-i);
 			i=j-1;
 		} else /*if(strchr("+*-/%~&|><={}",source[i])!=NULL)*/{
-			if(len==sz&&(sz*=2,tokens=realloc(tokens,sz,token_t))==NULL)outofmem();
-			tokens[len].type=TT_SYMBOL;
-			tokens[len].str=malloc(2,char);
-			if(!tokens[len].str)outofmem(); //rlly
-			tokens[len].str[0]=source[i];
-			tokens[len].str[1]='\0';
-			len++;
-			if(source[i]=='{')blockdepth++;
-			else if(source[i]=='}')blockdepth--;
-			if(blockdepth<0)
-				DESTROY_TOKENS_RETF("postl: Extra '}' in source");
+			ADD_TOKEN(TT_SYMBOL,source+i,1);
+			if(source[i]=='{'){
+				blockdepth++;
+				tokens[len-1].match=openbrace;
+				openbrace=len-1;
+			} else if(source[i]=='}'){
+				blockdepth--;
+				if(blockdepth<0)
+					DESTROY_TOKENS_RETF("postl: Extra '}' in source");
+				int outer=tokens[openbrace].match;
+				tokens[openbrace].match=len-1;
+				openbrace=outer;
+			}
 		} //else DESTROY_TOKENS_RET_MIN1;
-		//DBGF("i=%d, len=%d; tokens[%d].type=%d",i,len,len==0?-123:len-1,tokens[len==0?-123:len-1].type);
 	}
 
 	if(blockdepth<0)
@@ -305,6 +1068,7 @@ static const char* tokenise(token_t **tokensp,const char *source,int *ntokens){
 	if(blockdepth>0)
 		DESTROY_TOKENS_RETF("postl: Missing %d '{'%s in source",blockdepth,blockdepth==1?"":"s");
 
+#undef ADD_TOKEN
 #undef DESTROY_TOKENS_RETF
 
 	*tokensp=tokens;
@@ -312,220 +1076,963 @@ static const char* tokenise(token_t **tokensp,const char *source,int *ntokens){
 	return NULL;
 }
 
-static const char* execute_token(postl_program_t *prog,token_t token){
-	if(prog->buildblock){
-		if(strcmp(token.str,"}")==0&&--prog->blockdepth==0){
-			code_t *bb=prog->buildblock;
-			if(bb->len==bb->sz){
-				bb->sz++;
-				bb->tokens=realloc(bb->tokens,bb->sz,token_t);
-			}
-			bb->tokens[bb->len].type=TT_WORD;
-			asprintf(&bb->tokens[bb->len].str,"scopeleave");
-			if(!bb->tokens[bb->len].str)outofmem();
-			bb->len++;
-
-			stackitem_t *si=malloc(1,stackitem_t);
-			if(!si)outofmem();
-			si->val.type=POSTL_BLOCK;
-			si->val.strv=NULL;
-			si->val.blockv=bb;
-			prog->buildblock=NULL;
-			si->next=prog->stack;
-			prog->stack=si;
-			prog->stacksz++;
-		} else {
-			code_t *bb=prog->buildblock;
-			if(bb->len==bb->sz){
-				bb->sz*=2;
-				bb->tokens=realloc(bb->tokens,bb->sz,token_t);
-				if(!bb->tokens)outofmem();
+static char* copy_slice(arena_t *arena,const char *str,int len){
+	char *copy=arena_alloc(arena,len+1);
+	memcpy(copy,str,len);
+	copy[len]='\0';
+	return copy;
+}
+
+// returns NULL if sym was never bound in this program
+static funcmap_slot_t* funcmap_find(const postl_program_t *prog,int sym){
+	int mask=prog->fmapsz-1;
+	for(int i=prog->syms.syms[sym].hash&mask;prog->fmap[i].sym!=-1;i=(i+1)&mask){
+		if(prog->fmap[i].sym==sym)return &prog->fmap[i];
+	}
+	return NULL;
+}
+
+// returns the active item for sym, or NULL if none
+static funcmap_llitem_t* funcmap_lookup(const postl_program_t *prog,int sym){
+	funcmap_slot_t *slot=funcmap_find(prog,sym);
+	return slot?slot->bindings:NULL;
+}
+
+static funcmap_slot_t* funcmap_insertslot(const symtab_t *st,funcmap_slot_t *fmap,int fmapsz,int sym){
+	int mask=fmapsz-1;
+	int i=st->syms[sym].hash&mask;
+	while(fmap[i].sym!=-1)i=(i+1)&mask;
+	fmap[i].sym=sym;
+	return &fmap[i];
+}
+
+// makes lli the active item for its symbol
+static void funcmap_push(postl_program_t *prog,funcmap_llitem_t *lli){
+	int sym=lli->item.sym;
+	funcmap_slot_t *slot=funcmap_find(prog,sym);
+	if(!slot){
+		if(2*(prog->fmapused+1)>prog->fmapsz){ // keep the load factor at most 1/2
+			int newsz=2*prog->fmapsz;
+			funcmap_slot_t *newmap=malloc(newsz,funcmap_slot_t);
+			if(!newmap)outofmem();
+			for(int i=0;i<newsz;i++)newmap[i].sym=-1;
+			for(int i=0;i<prog->fmapsz;i++){
+				if(prog->fmap[i].sym==-1)continue;
+				funcmap_insertslot(&prog->syms,newmap,newsz,prog->fmap[i].sym)->bindings=prog->fmap[i].bindings;
 			}
-			bb->tokens[bb->len].type=token.type;
-			asprintf(&bb->tokens[bb->len].str,"%s",token.str);
-			if(!bb->tokens[bb->len].str)outofmem();
-			bb->len++;
-			if(strcmp(token.str,"{")==0)prog->blockdepth++;
+			free(prog->fmap);
+			prog->fmap=newmap;
+			prog->fmapsz=newsz;
 		}
-		return NULL;
+		slot=funcmap_insertslot(&prog->syms,prog->fmap,prog->fmapsz,sym);
+		slot->bindings=NULL;
+		prog->fmapused++;
 	}
-	switch(token.type){
-		case TT_NUM:{
-			double d=strtod(token.str,NULL);
-			stackitem_t *si=malloc(1,stackitem_t);
-			si->val.type=POSTL_NUM;
-			si->val.numv=d;
-			si->val.strv=NULL;
-			si->val.blockv=NULL;
-			si->next=prog->stack;
-			prog->stack=si;
-			prog->stacksz++;
-			break;
+	if(sym<NUM_BUILTINS)prog->builtinbound[sym]++;
+	lli->next=slot->bindings;
+	slot->bindings=lli;
+}
+
+// deletes the active item for sym; returns whether the function existed
+static bool deletefunction(postl_program_t *prog,int sym){
+	funcmap_slot_t *slot=funcmap_find(prog,sym);
+	if(!slot||!slot->bindings)return false;
+	funcmap_llitem_t *lli=slot->bindings;
+	slot->bindings=lli->next;
+	if(sym<NUM_BUILTINS)prog->builtinbound[sym]--;
+	funcmap_item_release(lli->item);
+	if(!lli->frozen)pool_free(&prog->fmappool,lli);
+	return true;
+}
+
+static const char* execute_builtin(postl_program_t *prog,builtin_enum_t id);
+static const char* callfunction(postl_program_t *prog,int sym);
+
+// Returned like an error by a call to a C function that suspended its caller
+static const char suspended[]="postl: Suspended";
+
+
+static void scope_enter(postl_program_t *prog){
+	if(prog->nscopes==prog->scopestackcap){
+		prog->scopestackcap*=2;
+		prog->scopestack=realloc(prog->scopestack,prog->scopestackcap,int);
+		if(!prog->scopestack)outofmem();
+	}
+	prog->scopestack[prog->nscopes++]=prog->scopeloglen;
+}
+
+// returns false if there was no scope to leave
+static bool scope_leave(postl_program_t *prog){
+	if(prog->nscopes==0)return false;
+	int start=prog->scopestack[--prog->nscopes];
+	while(prog->scopeloglen>start){
+		int sym=prog->scopelog[--prog->scopeloglen];
+		DBGF("- '%s'",symbol_name(&prog->syms,sym));
+		deletefunction(prog,sym);
+	}
+	return true;
+}
+
+
+// op, op with a constant right operand, builtin, result for numbers x and y
+#define ARITH_OPS(X) \
+	X(OP_ADD,OP_ADDK,BI_PLUS,x+y) \
+	X(OP_SUB,OP_SUBK,BI_MINUS,x-y) \
+	X(OP_MUL,OP_MULK,BI_TIMES,x*y) \
+	X(OP_DIV,OP_DIVK,BI_DIVIDE,y==0?nan(""):x/y) \
+	X(OP_EQ,OP_EQK,BI_EQ,x==y) \
+	X(OP_GT,OP_GTK,BI_GT,x>y) \
+	X(OP_LT,OP_LTK,BI_LT,x<y)
+
+// op with a constant right operand, that preceded by a dup, builtin, result
+#define DUP_COMPARE_OPS(X) \
+	X(OP_EQK,OP_DUPEQK,BI_EQ,x==y) \
+	X(OP_GTK,OP_DUPGTK,BI_GT,x>y) \
+	X(OP_LTK,OP_DUPLTK,BI_LT,x<y)
+
+// Peephole pass: marks the starts of common instruction sequences with the
+// superinstruction that runs them in one go. Off when profiling, so that the
+// profile shows what the code actually consists of.
+static void fuse_instrs(code_t *code){
+	instr_t *instrs=code->instrs;
+	for(int i=0;i<code->len;i++)instrs[i].xop=instrs[i].op;
+#ifndef POSTL_PROFILE
+	// Back to front, so that the xop of the next instruction is already known
+	for(int i=code->len-2;i>=0;i--){
+		opcode_t next=instrs[i+1].op;
+		switch(instrs[i].op){
+			case OP_NUM:
+				switch(next){
+#define X(op,kop,bi,expr) case op: instrs[i].xop=kop; break;
+					ARITH_OPS(X)
+#undef X
+					default: break;
+				}
+				break;
+			case OP_DUP:
+				switch(instrs[i+1].xop){
+#define X(kop,dupop,bi,expr) case kop: instrs[i].xop=dupop; break;
+					DUP_COMPARE_OPS(X)
+#undef X
+					default: break;
+				}
+				break;
+			case OP_BLOCK:
+				if(next==OP_BUILTIN&&instrs[i+1].sym==BI_IF)instrs[i].xop=OP_IFBLOCK;
+				else if(next==OP_BUILTIN&&instrs[i+1].sym==BI_WHILE)instrs[i].xop=OP_WHILEBLOCK;
+				else if(next==OP_BLOCK&&i+2<code->len&&instrs[i+2].op==OP_BUILTIN&&instrs[i+2].sym==BI_IFELSE)
+					instrs[i].xop=OP_IFELSEBLOCKS;
+				break;
+			default:
+				break;
 		}
-		case TT_STR:{
-			stackitem_t *si=malloc(1,stackitem_t);
-			si->val.type=POSTL_STR;
-			asprintf(&si->val.strv,"%s",token.str);
-			if(!si->val.strv)outofmem();
-			si->val.blockv=NULL;
-			si->next=prog->stack;
-			prog->stack=si;
-			prog->stacksz++;
+	}
+#endif
+}
+
+static opcode_t builtin_opcode(builtin_enum_t id){
+	switch(id){
+		case BI_PLUS: return OP_ADD;
+		case BI_MINUS: return OP_SUB;
+		case BI_TIMES: return OP_MUL;
+		case BI_DIVIDE: return OP_DIV;
+		case BI_EQ: return OP_EQ;
+		case BI_GT: return OP_GT;
+		case BI_LT: return OP_LT;
+		case BI_DUP: return OP_DUP;
+		case BI_SWAP: return OP_SWAP;
+		case BI_POP: return OP_POP;
+		default: return OP_BUILTIN;
+	}
+}
+
+// Compiles tokens from *idx up to the matching '}' (or the end of the token
+// list if !isblock) into unit, leaving *idx at that '}'. Everything that's kept
+// is copied out of the tokens, which don't outlive compilation.
+// A block only gets its own scope if its body (not counting nested blocks,
+// which get their own) might def something into it: directly, via 'builtin',
+// by manipulating the scope stack, or by calling a C function. A C function
+// registered after code calling it was compiled can't be seen here; the block
+// gets its scope when the function is called instead.
+static bool sym_needs_scope(const symtab_t *st,int sym){
+	switch(sym){
+		case BI_DEF: case BI_BUILTIN: case BI_SCOPEENTER: case BI_SCOPELEAVE:
+			return true;
+		default:
+			return st->syms[sym].cfunc;
+	}
+}
+
+static code_t* compile(symtab_t *st,codeunit_t *unit,token_t *tokens,int ntokens,int *idx,bool isblock){
+	int ninstrs=0;
+	for(int i=*idx;i<ntokens;i++,ninstrs++){
+		if(tokens[i].type!=TT_SYMBOL)continue;
+		if(tokens[i].str[0]=='}')break;
+		if(tokens[i].str[0]=='{')i=tokens[i].match;
+	}
+
+	code_t *code=arena_alloc(&unit->arena,sizeof(code_t));
+	code->unit=unit;
+	code->scoped=false;
+	code->block=isblock;
+	code->len=0;
+	code->instrs=ninstrs==0?NULL:arena_alloc(&unit->arena,ninstrs*sizeof(instr_t));
+
+	for(;*idx<ntokens;(*idx)++){
+		token_t *token=&tokens[*idx];
+		bool issym=token->type==TT_WORD||token->type==TT_SYMBOL;
+		if(token->type==TT_SYMBOL&&token->str[0]=='}'){
+			assert(isblock);
 			break;
 		}
-		case TT_PPC:
-			return "No preprocessor commands known";
-		case TT_WORD:
-		case TT_SYMBOL:
-			return postl_callfunction(prog,token.str);
+
+		assert(code->len<ninstrs);
+		instr_t *in=&code->instrs[code->len++];
+
+		if(token->type==TT_SYMBOL&&token->str[0]=='{'){
+			(*idx)++;
+			in->op=OP_BLOCK;
+			in->str=NULL;
+			in->blockv=compile(st,unit,tokens,ntokens,idx,true);
+			continue;
+		}
+
+		if(issym){
+			in->str=NULL;
+			in->sym=symbol_intern_n(st,token->str,token->len);
+			in->op=in->sym<NUM_BUILTINS?builtin_opcode(in->sym):OP_CALL;
+			if(sym_needs_scope(st,in->sym))code->scoped=isblock;
+			continue;
+		}
+
+		if(token->type==TT_STR){
+			in->op=OP_STR;
+			in->str=NULL;
+			in->strv=str_make(token->str,token->len);
+			codeunit_addstr(unit,in->strv);
+			continue;
+		}
+
+		in->str=copy_slice(&unit->arena,token->str,token->len);
+		switch(token->type){
+			case TT_NUM:
+				in->op=OP_NUM;
+				in->numv=token->numv;
+				break;
+			case TT_PPC:
+				in->op=OP_PPC;
+				break;
+			case TT_STR:
+			case TT_WORD:
+			case TT_SYMBOL:
+				assert(false);
+		}
 	}
-	return NULL;
+
+	assert(code->len==ninstrs);
+	fuse_instrs(code);
+	return code;
+}
+
+// Compiled code can be saved as an image, which is loaded again without
+// tokenising or compiling. The image holds the names of the symbols the code
+// uses, its blocks in breadth-first order (the top level first, and every
+// block after the one containing it) and their instructions, which refer to
+// symbols and blocks by index. Names, string literals and the source text of
+// numbers are in a data section at the end. Loading interns the names and
+// rebuilds the code in a fresh unit; superinstructions and scopes are worked
+// out again, since they depend on the loading program.
+// Images are in the byte order of the machine that made them.
+#define IMAGE_MAGIC "PSLC"
+#define IMAGE_VERSION 1
+
+typedef struct image_header_t{
+	char magic[4];
+	uint32_t version;
+	uint32_t size; // of the whole image
+	uint32_t checksum; // of everything after the header
+	uint32_t nsyms,nblocks,ninstrs;
+	uint32_t datalen;
+} image_header_t;
+
+typedef struct image_ref_t{
+	uint32_t off,len; // in the data section
+} image_ref_t;
+
+typedef struct image_block_t{
+	uint32_t first,len; // in the instruction section
+} image_block_t;
+
+typedef enum image_kind_t{
+	IK_NUM,   // numv, text
+	IK_STR,   // text
+	IK_BLOCK, // arg is the block index
+	IK_PPC,   // text
+	IK_SYM,   // arg is the symbol index
+} image_kind_t;
+
+typedef struct image_instr_t{
+	uint32_t kind;
+	uint32_t arg;
+	image_ref_t text;
+	double numv;
+} image_instr_t;
+
+static uint32_t image_checksum(const char *data,size_t len){
+	uint64_t h=14695981039346656037u;
+	size_t i=0;
+	for(;i+8<=len;i+=8){
+		uint64_t w;
+		memcpy(&w,data+i,8);
+		h=(h^w)*1099511628211u;
+		h^=h>>29;
+	}
+	for(;i<len;i++)h=(h^(unsigned char)data[i])*1099511628211u;
+	return h^(h>>32);
+}
+
+typedef struct bytebuf_t{
+	char *data;
+	size_t len,cap;
+} bytebuf_t;
+
+// returns a pointer to n bytes added at the end, which may move on the next call
+static void* bytebuf_add(bytebuf_t *bb,size_t n){
+	if(bb->len+n>bb->cap){
+		bb->cap=2*(bb->len+n);
+		bb->data=realloc(bb->data,bb->cap,char);
+		if(!bb->data)outofmem();
+	}
+	bb->len+=n;
+	return bb->data+bb->len-n;
+}
+
+static image_ref_t image_adddata(bytebuf_t *data,const char *str,int len){
+	image_ref_t ref={data->len,len};
+	memcpy(bytebuf_add(data,len),str,len);
+	return ref;
+}
+
+// maybe returns error string; on success, *imagep is malloc'ed
+static const char* image_save(const symtab_t *st,code_t *top,char **imagep,size_t *sizep){
+	bytebuf_t syms={0},blocks={0},instrs={0},data={0};
+	int *symidx=malloc(st->nsyms,int);
+	if(!symidx)outofmem();
+	for(int i=0;i<st->nsyms;i++)symidx[i]=-1;
+	int nsyms=0,nblocks=1,queuecap=16;
+	code_t **queue=malloc(queuecap,code_t*);
+	if(!queue)outofmem();
+	queue[0]=top;
+
+	for(int b=0;b<nblocks;b++){
+		const code_t *code=queue[b];
+		image_block_t *ib=bytebuf_add(&blocks,sizeof(image_block_t));
+		ib->first=instrs.len/sizeof(image_instr_t);
+		ib->len=code->len;
+		for(int i=0;i<code->len;i++){
+			const instr_t *in=&code->instrs[i];
+			image_instr_t ii={0};
+			switch(in->op){
+				case OP_NUM:
+					ii.kind=IK_NUM;
+					ii.numv=in->numv;
+					ii.text=image_adddata(&data,in->str,strlen(in->str));
+					break;
+				case OP_STR:
+					ii.kind=IK_STR;
+					ii.text=image_adddata(&data,in->strv->data,in->strv->len);
+					break;
+				case OP_PPC:
+					ii.kind=IK_PPC;
+					ii.text=image_adddata(&data,in->str,strlen(in->str));
+					break;
+				case OP_BLOCK:
+					ii.kind=IK_BLOCK;
+					if(nblocks==queuecap){
+						queuecap*=2;
+						queue=realloc(queue,queuecap,code_t*);
+						if(!queue)outofmem();
+					}
+					ii.arg=nblocks;
+					queue[nblocks++]=in->blockv;
+					break;
+				default:
+					assert(OP_HAS_SYM(in->op));
+					ii.kind=IK_SYM;
+					if(symidx[in->sym]==-1){
+						const char *name=symbol_name(st,in->sym);
+						*(image_ref_t*)bytebuf_add(&syms,sizeof(image_ref_t))=image_adddata(&data,name,strlen(name));
+						symidx[in->sym]=nsyms++;
+					}
+					ii.arg=symidx[in->sym];
+					break;
+			}
+			memcpy(bytebuf_add(&instrs,sizeof(ii)),&ii,sizeof(ii));
+		}
+	}
+	free(symidx);
+	free(queue);
+
+	size_t size=sizeof(image_header_t)+syms.len+blocks.len+instrs.len+data.len;
+	const char *errstr=NULL;
+	if(size>UINT32_MAX)errstr="postl: Compiled code too large to save";
+	else {
+		image_header_t h;
+		memcpy(h.magic,IMAGE_MAGIC,4);
+		h.version=IMAGE_VERSION;
+		h.size=size;
+		h.nsyms=nsyms;
+		h.nblocks=nblocks;
+		h.ninstrs=instrs.len/sizeof(image_instr_t);
+		h.datalen=data.len;
+		char *image=malloc(size,char);
+		if(!image)outofmem();
+		char *p=image+sizeof(h);
+		const bytebuf_t *sections[4]={&syms,&blocks,&instrs,&data};
+		for(int i=0;i<4;i++){
+			if(sections[i]->len)memcpy(p,sections[i]->data,sections[i]->len);
+			p+=sections[i]->len;
+		}
+		h.checksum=image_checksum(image+sizeof(h),size-sizeof(h));
+		memcpy(image,&h,sizeof(h));
+		*imagep=image;
+		*sizep=size;
+	}
+	free(syms.data);
+	free(blocks.data);
+	free(instrs.data);
+	free(data.data);
+	return errstr;
 }
 
-// maybe returns error string
-static const char* execute_block(postl_program_t *prog,code_t block){
-	for(int i=0;i<block.len;i++){
-		const char *errstr=execute_token(prog,block.tokens[i]);
-		if(errstr)return errstr;
+// maybe returns error string; on success, *codep is the top level of the
+// image, in a new unit
+static const char* image_load(symtab_t *st,const char *image,size_t size,code_t **codep){
+	image_header_t h;
+	if(size<sizeof(h)||memcmp(image,IMAGE_MAGIC,4)!=0)return "postl: Not compiled postl code";
+	memcpy(&h,image,sizeof(h));
+	if(h.version!=IMAGE_VERSION)return "postl: Compiled code is for a different version of postl";
+	if(h.size!=size)return "postl: Compiled code is truncated or has trailing data";
+	if(sizeof(h)+(uint64_t)h.nsyms*sizeof(image_ref_t)+(uint64_t)h.nblocks*sizeof(image_block_t)
+			+(uint64_t)h.ninstrs*sizeof(image_instr_t)+h.datalen!=size||h.nblocks==0)
+		return "postl: Compiled code is malformed";
+	if(image_checksum(image+sizeof(h),size-sizeof(h))!=h.checksum)
+		return "postl: Compiled code is corrupt (checksum mismatch)";
+
+	const char *symsec=image+sizeof(h);
+	const char *blocksec=symsec+h.nsyms*sizeof(image_ref_t);
+	const char *instrsec=blocksec+h.nblocks*sizeof(image_block_t);
+	const char *data=instrsec+h.ninstrs*sizeof(image_instr_t);
+#define REF_OK(ref) ((uint64_t)(ref).off+(ref).len<=h.datalen&&(ref).len<=INT_MAX)
+
+	int *symmap=malloc(h.nsyms>0?h.nsyms:1,int);
+	if(!symmap)outofmem();
+	for(uint32_t i=0;i<h.nsyms;i++){
+		image_ref_t ref;
+		memcpy(&ref,symsec+i*sizeof(ref),sizeof(ref));
+		if(!REF_OK(ref)||ref.len==0||memchr(data+ref.off,'\0',ref.len)){
+			free(symmap);
+			return "postl: Compiled code is malformed";
+		}
+		symmap[i]=symbol_intern_n(st,data+ref.off,ref.len);
 	}
+
+	codeunit_t *unit=codeunit_make();
+	code_t *codes=arena_alloc(&unit->arena,h.nblocks*sizeof(code_t));
+	instr_t *instrs=h.ninstrs==0?NULL:arena_alloc(&unit->arena,h.ninstrs*sizeof(instr_t));
+	uint32_t next=0; // blocks' instructions follow each other
+	for(uint32_t b=0;b<h.nblocks;b++){
+		image_block_t ib;
+		memcpy(&ib,blocksec+b*sizeof(ib),sizeof(ib));
+		if(ib.first!=next||ib.len>h.ninstrs-next)goto malformed;
+		next+=ib.len;
+		code_t *code=&codes[b];
+		code->unit=unit;
+		code->scoped=false;
+		code->block=b>0;
+		code->len=ib.len;
+		code->instrs=ib.len==0?NULL:instrs+ib.first;
+		for(int i=0;i<code->len;i++){
+			image_instr_t ii;
+			memcpy(&ii,instrsec+(ib.first+i)*sizeof(ii),sizeof(ii));
+			instr_t *in=&code->instrs[i];
+			in->str=NULL;
+			switch(ii.kind){
+				case IK_NUM:
+				case IK_PPC:
+					if(!REF_OK(ii.text))goto malformed;
+					in->op=ii.kind==IK_NUM?OP_NUM:OP_PPC;
+					in->numv=ii.numv;
+					in->str=copy_slice(&unit->arena,data+ii.text.off,ii.text.len);
+					break;
+				case IK_STR:
+					if(!REF_OK(ii.text))goto malformed;
+					in->op=OP_STR;
+					in->strv=str_make(data+ii.text.off,ii.text.len);
+					codeunit_addstr(unit,in->strv);
+					break;
+				case IK_BLOCK:
+					// only later blocks, so that blocks can't contain themselves
+					if(ii.arg<=b||ii.arg>=h.nblocks)goto malformed;
+					in->op=OP_BLOCK;
+					in->blockv=&codes[ii.arg];
+					break;
+				case IK_SYM:
+					if(ii.arg>=h.nsyms)goto malformed;
+					in->sym=symmap[ii.arg];
+					in->op=in->sym<NUM_BUILTINS?builtin_opcode(in->sym):OP_CALL;
+					if(sym_needs_scope(st,in->sym))code->scoped=b>0;
+					break;
+				default:
+					goto malformed;
+			}
+		}
+	}
+	if(next!=h.ninstrs)goto malformed;
+#undef REF_OK
+
+	for(uint32_t b=0;b<h.nblocks;b++)fuse_instrs(&codes[b]);
+	free(symmap);
+	*codep=&codes[0];
 	return NULL;
+
+malformed:
+	// instructions not yet filled in hold no references
+	free(symmap);
+	codeunit_release(unit);
+	return "postl: Compiled code is malformed";
 }
 
-// returns whether the function existed
-static bool deletefunction(postl_program_t *prog,const char *name){
-	int h=namehash(name);
-	funcmap_llitem_t *lli=prog->fmap[h],*parent=NULL;
-	while(lli){
-		if(strcmp(lli->item.name,name)==0)break;
-		parent=lli;
-		lli=lli->next;
-	}
-	if(!lli)return false;
-	if(parent==NULL)prog->fmap[h]=lli->next;
-	else parent->next=lli->next;
-	free(lli->item.name);
-	if(lli->item.code.sz){
-		for(int i=0;i<lli->item.code.len;i++){
-			free(lli->item.code.tokens[i].str);
+#ifdef POSTL_PROFILE
+static unsigned int profile_hash(const code_t *code,int idx,int n){
+	return ((unsigned int)((uintptr_t)code>>4)*2654435761u)^(idx*40503u)^n;
+}
+
+static profile_entry_t* profile_slot(profile_entry_t *entries,int sz,const code_t *code,int idx,int n){
+	int mask=sz-1;
+	int i=profile_hash(code,idx,n)&mask;
+	while(entries[i].code&&(entries[i].code!=code||entries[i].idx!=idx||entries[i].n!=n))i=(i+1)&mask;
+	return &entries[i];
+}
+
+static void profile_record(postl_program_t *prog,const code_t *code,int idx){
+	profile_t *pr=&prog->profile;
+	pr->ninstrs++;
+	for(int n=2;n<=PROFILE_MAXN&&n<=idx+1;n++){
+		profile_entry_t *e=profile_slot(pr->entries,pr->sz,code,idx,n);
+		if(e->code){
+			e->count++;
+			continue;
+		}
+		if(2*(pr->used+1)>pr->sz){ // keep the load factor at most 1/2
+			int newsz=2*pr->sz;
+			profile_entry_t *newentries=calloc(newsz,sizeof(profile_entry_t));
+			if(!newentries)outofmem();
+			for(int i=0;i<pr->sz;i++){
+				if(!pr->entries[i].code)continue;
+				const profile_entry_t *old=&pr->entries[i];
+				*profile_slot(newentries,newsz,old->code,old->idx,old->n)=*old;
+			}
+			free(pr->entries);
+			pr->entries=newentries;
+			pr->sz=newsz;
+			e=profile_slot(pr->entries,pr->sz,code,idx,n);
 		}
-		free(lli->item.code.tokens);
+		e->code=code_retain((code_t*)code);
+		e->idx=idx;
+		e->n=n;
+		e->count=1;
+		pr->used++;
+	}
+}
+
+typedef struct profile_ngram_t{
+	char *text;
+	int n;
+	long count;
+} profile_ngram_t;
+
+static int profile_ngram_cmp_text(const void *a_,const void *b_){
+	const profile_ngram_t *a=a_,*b=b_;
+	if(a->n!=b->n)return a->n-b->n;
+	return strcmp(a->text,b->text);
+}
+
+static int profile_ngram_cmp_count(const void *a_,const void *b_){
+	const profile_ngram_t *a=a_,*b=b_;
+	if(a->n!=b->n)return a->n-b->n;
+	return (a->count<b->count)-(a->count>b->count);
+}
+
+static char* profile_ngram_text(const symtab_t *st,const profile_entry_t *e){
+	char buf[256];
+	int len=0;
+	for(int i=e->idx-e->n+1;i<=e->idx&&len<(int)sizeof(buf);i++){
+		const instr_t *in=&e->code->instrs[i];
+		const char *sep=len==0?"":" ";
+		if(in->op==OP_STR)len+=snprintf(buf+len,sizeof(buf)-len,"%s\"%.*s\"",sep,in->strv->len,in->strv->data);
+		else if(in->op==OP_BLOCK)len+=snprintf(buf+len,sizeof(buf)-len,"%s{...}",sep);
+		else if(OP_HAS_SYM(in->op))len+=snprintf(buf+len,sizeof(buf)-len,"%s%s",sep,symbol_name(st,in->sym));
+		else len+=snprintf(buf+len,sizeof(buf)-len,"%s%s",sep,in->str);
+	}
+	char *text=strdup(buf);
+	if(!text)outofmem();
+	return text;
+}
+#endif
+
+
+// With GCC's labels-as-values, every instruction jumps straight to the handler
+// of the next one (direct threading); otherwise it's a switch in a loop.
+#if defined(__GNUC__)&&!defined(POSTL_NO_COMPUTED_GOTO)&&!defined(POSTL_PROFILE)
+#define USE_COMPUTED_GOTO
+#endif
+
+// Blocks don't run on the C stack: every block running has a frame, and the
+// dispatch loop switches between frames itself. So a run can stop between any
+// two blocks and be picked up again later, and deep recursion in a script
+// only costs memory.
+typedef struct frame_t{
+	code_t *code; // retained
+	const instr_t *pc; // where to go on when this frame is returned to
+	int nscopes; // before the block's own scope was entered
+	bool scoped; // whether the block has entered a scope of its own
+	bool loop; // the body of a while: runs again while the value it leaves is true
+} frame_t;
+
+// Where the budget segment that in is in ends: code is run (and fuel taken
+// for it) at most BUDGET_SLICE instructions at a time
+static inline const instr_t* segment_end(const code_t *code,const instr_t *in){
+	if(code->len<=BUDGET_SLICE)return code->instrs+code->len;
+	long segend=((in-code->instrs)/BUDGET_SLICE+1)*BUDGET_SLICE;
+	return code->instrs+(segend<code->len?segend:code->len);
+}
+
+// takes over the reference to code; the dispatch loop runs it next
+static void frame_push(postl_program_t *prog,code_t *code,bool loop){
+	if(prog->nframes==prog->framescap){
+		prog->framescap*=2;
+		prog->frames=realloc(prog->frames,prog->framescap,frame_t);
+		if(!prog->frames)outofmem();
 	}
-	free(lli);
+	frame_t *f=&prog->frames[prog->nframes++];
+	f->code=code;
+	f->pc=code->instrs;
+	f->nscopes=prog->nscopes;
+	f->scoped=code->scoped;
+	f->loop=loop;
+	if(code->scoped)scope_enter(prog);
+	prog->budget.fuel-=segment_end(code,code->instrs)-code->instrs+1;
+}
+
+// Drops the frames above base, and the scopes they opened
+static void frames_unwind(postl_program_t *prog,int base){
+	if(prog->nframes<=base)return;
+	int nscopes=prog->frames[base].nscopes;
+	while(prog->nframes>base)code_release(prog->frames[--prog->nframes].code);
+	while(prog->nscopes>nscopes)scope_leave(prog);
+}
+
+static double monotime(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void budget_refill(budget_t *b){
+	long slice=BUDGET_SLICE;
+	if(b->max>0&&b->max-b->used<slice)slice=b->max-b->used;
+	b->fuel=b->given=slice;
+}
+
+// at the start of a run that isn't nested in another
+static void budget_start(budget_t *b){
+	b->used=0;
+	b->deadline=b->seconds>0?monotime()+b->seconds:0;
+	budget_refill(b);
+}
+
+// Called when the fuel has run out; returns whether the run must stop, with
+// the reason in prog->error
+static bool budget_check(postl_program_t *prog){
+	budget_t *b=&prog->budget;
+	b->used+=b->given-b->fuel;
+	const char *reason=NULL;
+	if(__atomic_exchange_n(&b->interrupted,false,__ATOMIC_RELAXED))reason="postl: Interrupted";
+	else if(b->max>0&&b->used>=b->max)reason="postl: Instruction budget exhausted";
+	else if(b->deadline>0&&monotime()>=b->deadline)reason="postl: Time limit exceeded";
+	budget_refill(b);
+	if(!reason)return false;
+	prog->error=reason;
 	return true;
 }
 
-typedef enum builtin_enum_t{
-	BI_PLUS, BI_MINUS, BI_TIMES, BI_DIVIDE, BI_MODULO,
-	BI_EQ, BI_GT, BI_LT,
-	BI_NOT,
-	BI_PRINT, BI_LF,
-	BI_GETC,
-	BI_BLOCKOPEN, /*BI_BLOCKCLOSE,*/ //blockclose is directly handled by execute_token
-	BI_DEF, BI_GDEF,
-	BI_EVAL,
-	BI_BUILTIN,
-	BI_SWAP, BI_DUP, BI_POP, BI_ROLL, BI_ROTATE,
-	BI_IF, BI_WHILE, BI_IFELSE,
-	BI_STACKSIZE,
-	BI_STACKDUMP,
-	BI_CEIL, BI_FLOOR, BI_ROUND, BI_MIN, BI_MAX, BI_ABS, BI_SQRT, BI_EXP, BI_LOG, BI_POW,
-	BI_SIN, BI_COS, BI_TAN, BI_ASIN, BI_ACOS, BI_ATAN, BI_ATAN2, BI_E, BI_PI,
-	BI_STRIDX, BI_SUBSTR, BI_STRLEN, BI_CHR, BI_ORD,
-	BI_SCOPEENTER, BI_SCOPELEAVE
-} builtin_enum_t;
+// Runs the frames above base until they've all returned, or the budget runs
+// out. The error or reason for stopping is left in prog->error; after an error
+// the frames above base are gone, after preemption they're left to resume.
+static postl_status_t run(postl_program_t *prog,int base){
+	const char *errstr;
+	int depth; // of the frame running
+	code_t *code;
+	const instr_t *in,*end;
+
+#ifdef USE_COMPUTED_GOTO
+	static const void *const optable[NUM_OPS]={
+		[OP_NUM]=&&L_OP_NUM, [OP_STR]=&&L_OP_STR, [OP_BLOCK]=&&L_OP_BLOCK, [OP_PPC]=&&L_OP_PPC,
+		[OP_CALL]=&&L_OP_CALL, [OP_BUILTIN]=&&L_OP_BUILTIN,
+		[OP_ADD]=&&L_OP_ADD, [OP_SUB]=&&L_OP_SUB, [OP_MUL]=&&L_OP_MUL, [OP_DIV]=&&L_OP_DIV,
+		[OP_EQ]=&&L_OP_EQ, [OP_GT]=&&L_OP_GT, [OP_LT]=&&L_OP_LT,
+		[OP_DUP]=&&L_OP_DUP, [OP_SWAP]=&&L_OP_SWAP, [OP_POP]=&&L_OP_POP,
+		[OP_ADDK]=&&L_OP_ADDK, [OP_SUBK]=&&L_OP_SUBK, [OP_MULK]=&&L_OP_MULK, [OP_DIVK]=&&L_OP_DIVK,
+		[OP_EQK]=&&L_OP_EQK, [OP_GTK]=&&L_OP_GTK, [OP_LTK]=&&L_OP_LTK,
+		[OP_DUPEQK]=&&L_OP_DUPEQK, [OP_DUPGTK]=&&L_OP_DUPGTK, [OP_DUPLTK]=&&L_OP_DUPLTK,
+		[OP_IFBLOCK]=&&L_OP_IFBLOCK, [OP_WHILEBLOCK]=&&L_OP_WHILEBLOCK,
+		[OP_IFELSEBLOCKS]=&&L_OP_IFELSEBLOCKS,
+	};
+#define CASE(op) case op: L_##op
+#define NEXT do { if(++in>=end)goto done; goto *optable[in->xop]; } while(0)
+#else
+#define CASE(op) case op
+#define NEXT continue
+#endif
+
+	// Numeric fast path for an arithmetic or comparison builtin; anything else,
+	// including a shadowed builtin, goes through the generic path
+#define FAST_BINARY(op,kop,bi,expr) \
+		CASE(op): \
+			if(!prog->builtinbound[bi]&&prog->stacksz>=2){ \
+				value_t *a=&prog->stack[prog->stacksz-2]; \
+				if(a[0].type==POSTL_NUM&&a[1].type==POSTL_NUM){ \
+					double x=a[0].numv,y=a[1].numv; \
+					a->numv=(expr); \
+					prog->stacksz--; \
+					NEXT; \
+				} \
+			} \
+			goto generic_builtin;
+
+	// The same with the right operand pushed by the OP_NUM before it
+#define FAST_BINARY_K(op,kop,bi,expr) \
+		CASE(kop): \
+			if(!prog->builtinbound[bi]&&prog->stacksz>=1){ \
+				value_t *a=&prog->stack[prog->stacksz-1]; \
+				if(a->type==POSTL_NUM){ \
+					double x=a->numv,y=in->numv; \
+					a->numv=(expr); \
+					in++; \
+					NEXT; \
+				} \
+			} \
+			goto push_num;
+
+#define FAST_DUP_COMPARE(kop,dupop,bi,expr) \
+		CASE(dupop): \
+			if(!prog->builtinbound[BI_DUP]&&!prog->builtinbound[bi] \
+					&&prog->stacksz>=1&&prog->stacksz<prog->stackcap){ \
+				value_t *a=&prog->stack[prog->stacksz-1]; \
+				if(a->type==POSTL_NUM){ \
+					double x=a->numv,y=in[1].numv; \
+					a[1]=a[0]; \
+					a[1].numv=(expr); \
+					prog->stacksz++; \
+					in+=2; \
+					NEXT; \
+				} \
+			} \
+			goto dup;
+
+	// After an instruction that may have started a block: if it did, run that,
+	// and come back after the instruction
+#define AFTER_CALL \
+		if(prog->nframes>depth){ \
+			prog->frames[depth-1].pc=in+1; \
+			goto enter; \
+		}
+
+enter:
+	if(prog->budget.fuel<0&&budget_check(prog))return POSTL_PREEMPTED;
+resume:
+	depth=prog->nframes;
+	code=prog->frames[depth-1].code;
+	in=prog->frames[depth-1].pc;
+	end=segment_end(code,in);
+rerun:
+	for(;in<end;in++){
+#ifdef POSTL_PROFILE
+		profile_record(prog,code,in-code->instrs);
+#endif
+		switch(in->xop){
+			CASE(OP_NUM):
+			push_num:
+				stack_push(prog,value_num(in->numv));
+				NEXT;
+
+			CASE(OP_STR):{
+				stack_push(prog,value_str(str_retain(in->strv)));
+				NEXT;
+			}
+
+			CASE(OP_BLOCK):
+			push_block:{
+				value_t val={.type=POSTL_BLOCK,.blockv=in->blockv};
+				stack_push(prog,value_copy(val));
+				NEXT;
+			}
+
+			CASE(OP_PPC):
+				errstr="No preprocessor commands known";
+				goto fail;
+
+			CASE(OP_CALL):
+				if((errstr=callfunction(prog,in->sym)))goto fail;
+				AFTER_CALL;
+				NEXT;
+
+			ARITH_OPS(FAST_BINARY)
+			ARITH_OPS(FAST_BINARY_K)
+			DUP_COMPARE_OPS(FAST_DUP_COMPARE)
+
+			CASE(OP_DUP):
+			dup:
+				if(!prog->builtinbound[in->sym]&&prog->stacksz>=1&&prog->stacksz<prog->stackcap
+						&&prog->stack[prog->stacksz-1].type==POSTL_NUM){
+					prog->stack[prog->stacksz]=prog->stack[prog->stacksz-1];
+					prog->stacksz++;
+					NEXT;
+				}
+				goto generic_builtin;
+
+			CASE(OP_SWAP):
+				if(!prog->builtinbound[in->sym]&&prog->stacksz>=2){
+					value_t tmp=prog->stack[prog->stacksz-1];
+					prog->stack[prog->stacksz-1]=prog->stack[prog->stacksz-2];
+					prog->stack[prog->stacksz-2]=tmp;
+					NEXT;
+				}
+				goto generic_builtin;
+
+			CASE(OP_POP):
+				if(!prog->builtinbound[in->sym]&&prog->stacksz>=1
+						&&prog->stack[prog->stacksz-1].type==POSTL_NUM){
+					prog->stacksz--;
+					NEXT;
+				}
+				goto generic_builtin;
+
+			CASE(OP_BUILTIN):
+			generic_builtin:
+				if(!prog->builtinbound[in->sym])errstr=execute_builtin(prog,in->sym);
+				else errstr=callfunction(prog,in->sym);
+				if(errstr)goto fail;
+				AFTER_CALL;
+				NEXT;
+
+			// Like BI_IF and BI_WHILE, but without pushing and popping the block
+			CASE(OP_IFBLOCK):
+			CASE(OP_WHILEBLOCK):{
+				if(prog->builtinbound[in[1].sym]||prog->stacksz<1)goto push_block;
+				const instr_t *block=in++;
+				value_t cond=stack_pop(prog);
+				bool condval=istruthy(cond);
+				value_release(cond);
+				if(condval){
+					prog->frames[depth-1].pc=in+1;
+					frame_push(prog,code_retain(block->blockv),block->xop==OP_WHILEBLOCK);
+					goto enter;
+				}
+				NEXT;
+			}
+
+			CASE(OP_IFELSEBLOCKS):{
+				if(prog->builtinbound[BI_IFELSE]||prog->stacksz<1)goto push_block;
+				value_t cond=stack_pop(prog);
+				bool condval=istruthy(cond);
+				value_release(cond);
+				prog->frames[depth-1].pc=in+3;
+				frame_push(prog,code_retain(condval?in[0].blockv:in[1].blockv),false);
+				goto enter;
+			}
+
+			case NUM_OPS:
+				assert(false);
+		}
+	}
+
+#undef FAST_BINARY
+#undef FAST_BINARY_K
+#undef FAST_DUP_COMPARE
+#undef AFTER_CALL
+#undef CASE
+#undef NEXT
+
+#ifdef USE_COMPUTED_GOTO
+done:
+#endif
+	// The end of a segment of long code (a fused instruction may have run
+	// past it): take fuel for the next one
+	if(code->len>BUDGET_SLICE&&in<code->instrs+code->len){
+		end=segment_end(code,in);
+		if((prog->budget.fuel-=end-in)>=0)goto rerun;
+		prog->frames[depth-1].pc=in;
+		goto enter;
+	}
+	if(prog->frames[depth-1].scoped&&!scope_leave(prog)){
+		errstr="postl: scopeleave on empty scope stack";
+		goto fail;
+	}
+	if(prog->frames[depth-1].loop){
+		value_t cond=stack_pop(prog);
+		bool again=istruthy(cond);
+		value_release(cond);
+		if(again){
+			in=code->instrs;
+			if(code->len>BUDGET_SLICE)end=segment_end(code,in);
+			prog->frames[depth-1].scoped=code->scoped;
+			if(code->scoped)scope_enter(prog);
+			if((prog->budget.fuel-=end-in+1)>=0)goto rerun;
+			prog->frames[depth-1].pc=in;
+			goto enter;
+		}
+	}
+	prog->nframes--;
+	code_release(code);
+	if(prog->nframes==base)return POSTL_DONE;
+	goto resume;
+
+fail:
+	if(errstr==suspended){
+		prog->frames[depth-1].pc=in+1;
+		prog->error=NULL;
+		return POSTL_PENDING;
+	}
+	prog->error=errstr;
+	frames_unwind(prog,base);
+	return POSTL_ERROR;
+}
 
-typedef struct builtin_llitem_t {
-	builtin_enum_t id;
-	const char *name;
-	struct builtin_llitem_t *next;
-} builtin_llitem_t;
-
-static builtin_llitem_t *builtins_hmap[HASHMAP_SIZE]={NULL};
-static bool builtins_hmap_initialised=false;
-
-static void builtin_add(const char *name,builtin_enum_t id){
-	int h=namehash(name);
-	builtin_llitem_t *lli=malloc(1,builtin_llitem_t);
-	if(!lli)outofmem();
-	lli->id=id;
-	lli->name=name;
-	lli->next=builtins_hmap[h];
-	builtins_hmap[h]=lli;
-}
-
-static void initialise_builtins_hmap(void){
-	builtin_add("+",         BI_PLUS);
-	builtin_add("-",         BI_MINUS);
-	builtin_add("*",         BI_TIMES);
-	builtin_add("/",         BI_DIVIDE);
-	builtin_add("%",         BI_MODULO);
-	builtin_add("=",         BI_EQ);
-	builtin_add(">",         BI_GT);
-	builtin_add("<",         BI_LT);
-	builtin_add("!",         BI_NOT);
-	builtin_add("print",     BI_PRINT);
-	builtin_add("lf",        BI_LF);
-	builtin_add("getc",      BI_GETC);
-	builtin_add("{",         BI_BLOCKOPEN);
-	builtin_add("def",       BI_DEF);
-	builtin_add("gdef",      BI_GDEF);
-	builtin_add("eval",      BI_EVAL);
-	builtin_add("builtin",   BI_BUILTIN);
-	builtin_add("swap",      BI_SWAP);
-	builtin_add("dup",       BI_DUP);
-	builtin_add("pop",       BI_POP);
-	builtin_add("roll",      BI_ROLL);
-	builtin_add("rotate",    BI_ROTATE);
-	builtin_add("if",        BI_IF);
-	builtin_add("while",     BI_WHILE);
-	builtin_add("ifelse",    BI_IFELSE);
-	builtin_add("stacksize", BI_STACKSIZE);
-	builtin_add("stackdump", BI_STACKDUMP);
-	builtin_add("ceil",      BI_CEIL);
-	builtin_add("floor",     BI_FLOOR);
-	builtin_add("round",     BI_ROUND);
-	builtin_add("min",       BI_MIN);
-	builtin_add("max",       BI_MAX);
-	builtin_add("abs",       BI_ABS);
-	builtin_add("sqrt",      BI_SQRT);
-	builtin_add("exp",       BI_EXP);
-	builtin_add("log",       BI_LOG);
-	builtin_add("pow",       BI_POW);
-	builtin_add("sin",       BI_SIN);
-	builtin_add("cos",       BI_COS);
-	builtin_add("tan",       BI_TAN);
-	builtin_add("asin",      BI_ASIN);
-	builtin_add("acos",      BI_ACOS);
-	builtin_add("atan",      BI_ATAN);
-	builtin_add("atan2",     BI_ATAN2);
-	builtin_add("E",         BI_E);
-	builtin_add("PI",        BI_PI);
-	builtin_add("stridx",    BI_STRIDX);
-	builtin_add("substr",    BI_SUBSTR);
-	builtin_add("strlen",    BI_STRLEN);
-	builtin_add("chr",       BI_CHR);
-	builtin_add("ord",       BI_ORD);
-	builtin_add("scopeenter",BI_SCOPEENTER);
-	builtin_add("scopeleave",BI_SCOPELEAVE);
-
-	builtins_hmap_initialised=true;
-}
-
-static const char* execute_builtin(postl_program_t *prog,const char *name,bool *found){
-	static char errbuf[256];
-	DBGF("execute_builtin(%p,%s,%p)",prog,name,found);
-	builtin_llitem_t *lli=builtins_hmap[namehash(name)];
-	while(lli){
-		if(strcmp(lli->name,name)==0)break;
-		lli=lli->next;
-	}
-	if(found)*found=(bool)lli;
-	if(!lli)return NULL;
+// Runs the frames above base to the end, for the calls that can't be resumed,
+// so running out of budget or being suspended is an error. maybe returns error
+// string
+static const char* run_to_end(postl_program_t *prog,int base){
+	if(prog->nframes==base)return NULL;
+	if(prog->running==0)budget_start(&prog->budget);
+	prog->running++;
+	postl_status_t status=run(prog,base);
+	prog->running--;
+	if(status==POSTL_DONE||status==POSTL_ERROR)return status==POSTL_DONE?NULL:prog->error;
+	frames_unwind(prog,base);
+	if(status==POSTL_PENDING)return "postl: Only code run by postl_runcode_step can be suspended";
+	return prog->error;
+}
+
+static const char* execute_builtin(postl_program_t *prog,builtin_enum_t id){
+	const char *name=builtin_names[id];
+	DBGF("execute_builtin(%p,%s)",prog,name);
 
 #define RETURN_WITH_ERROR(...) \
 		do { \
-			snprintf(errbuf,256,__VA_ARGS__); \
-			return errbuf; \
+			snprintf(prog->errbuf,sizeof(prog->errbuf),__VA_ARGS__); \
+			return prog->errbuf; \
 		} while(0)
 
 #define STACKSIZE_CHECK(n) \
@@ -536,67 +2043,67 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 
 #define CANNOT_USE(type) RETURN_WITH_ERROR("postl: Cannot use %s in '%s'",valtype_string((type)),(name))
 
-	postl_stackval_t a,b;
-	postl_stackval_t res;
+	value_t a,b;
+	value_t res;
 
-	switch(lli->id){
+	switch(id){
 
 #define BINARY_ARITH_OP(id,expr) \
 		case (id): STACKSIZE_CHECK(2); \
-			b=postl_stack_pop(prog); \
-			a=postl_stack_pop(prog); \
+			b=stack_pop(prog); \
+			a=stack_pop(prog); \
 			if(a.type!=POSTL_NUM||b.type!=POSTL_NUM){ \
-				postl_stackval_release(a); \
-				postl_stackval_release(b); \
+				value_release(a); \
+				value_release(b); \
 				if(a.type!=POSTL_NUM)CANNOT_USE(a.type); \
 				else CANNOT_USE(b.type); \
 			} \
 			res.type=POSTL_NUM; \
 			res.numv=(expr); \
-			postl_stack_push(prog,res); \
-			postl_stackval_release(a); \
-			postl_stackval_release(b); \
+			stack_push(prog,res); \
+			value_release(a); \
+			value_release(b); \
 			break;
 
 #define UNARY_ARITH_OP(id,expr) \
 		case (id): STACKSIZE_CHECK(1); \
-			a=postl_stack_pop(prog); \
+			a=stack_pop(prog); \
 			if(a.type!=POSTL_NUM){ \
-				postl_stackval_release(a); \
+				value_release(a); \
 				CANNOT_USE(a.type); \
 			} \
 			res.type=POSTL_NUM; \
 			res.numv=(expr); \
-			postl_stack_push(prog,res); \
-			postl_stackval_release(a); \
+			stack_push(prog,res); \
+			value_release(a); \
 			break;
 
 
 		case BI_PLUS: STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
-			a=postl_stack_pop(prog);
+			b=stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=b.type){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Builtin '+' needs arguments of similar types (%s != %s)",
 					valtype_string(a.type),valtype_string(b.type));
 			}
 			if(a.type==POSTL_BLOCK){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				CANNOT_USE(POSTL_BLOCK);
 			} else if(a.type==POSTL_STR){
-				res.type=POSTL_STR;
-				asprintf(&res.strv,"%s%s",a.strv,b.strv);
-				if(!res.strv)outofmem();
+				stack_push(prog,value_str(str_append(a.strv,b.strv->data,b.strv->len)));
+				value_release(b);
+				break;
 			} else {
 				assert(a.type==POSTL_NUM);
 				res.type=POSTL_NUM;
 				res.numv=a.numv+b.numv;
 			}
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
-			postl_stackval_release(b);
+			stack_push(prog,res);
+			value_release(a);
+			value_release(b);
 			break;
 
 		BINARY_ARITH_OP(BI_MINUS,a.numv-b.numv)
@@ -605,268 +2112,302 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 		BINARY_ARITH_OP(BI_MODULO,floatmod(a.numv,b.numv))
 
 		case BI_EQ: STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
-			a=postl_stack_pop(prog);
+			b=stack_pop(prog);
+			a=stack_pop(prog);
 			res.type=POSTL_NUM;
 			if(a.type==POSTL_BLOCK||b.type==POSTL_BLOCK){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				CANNOT_USE(POSTL_BLOCK);
 			} else if(a.type!=b.type){
 				res.numv=0;
 			} else if(a.type==POSTL_STR){
 				res.type=POSTL_NUM;
-				res.numv=strcmp(a.strv,b.strv)==0;
+				res.numv=str_compare(a.strv,b.strv)==0;
 			} else {
 				assert(a.type==POSTL_NUM);
 				res.type=POSTL_NUM;
 				res.numv=a.numv==b.numv;
 			}
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
-			postl_stackval_release(b);
+			stack_push(prog,res);
+			value_release(a);
+			value_release(b);
 			break;
 
 		case BI_GT: STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
-			a=postl_stack_pop(prog);
+			b=stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=b.type){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Builtin '=' needs arguments of similar types (%s != %s)",
 					valtype_string(a.type),valtype_string(b.type));
 			}
 			if(a.type==POSTL_BLOCK){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				CANNOT_USE(POSTL_BLOCK);
 			} else if(a.type==POSTL_STR){
 				res.type=POSTL_NUM;
-				res.numv=strcmp(a.strv,b.strv)>0;
+				res.numv=str_compare(a.strv,b.strv)>0;
 			} else {
 				assert(a.type==POSTL_NUM);
 				res.type=POSTL_NUM;
 				res.numv=a.numv>b.numv;
 			}
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
-			postl_stackval_release(b);
+			stack_push(prog,res);
+			value_release(a);
+			value_release(b);
 			break;
 
 		case BI_LT: STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
-			a=postl_stack_pop(prog);
+			b=stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=b.type){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Builtin '=' needs arguments of similar types (%s != %s)",
 					valtype_string(a.type),valtype_string(b.type));
 			}
 			if(a.type==POSTL_BLOCK){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				CANNOT_USE(POSTL_BLOCK);
 			} else if(a.type==POSTL_STR){
 				res.type=POSTL_NUM;
-				res.numv=strcmp(a.strv,b.strv)<0;
+				res.numv=str_compare(a.strv,b.strv)<0;
 			} else {
 				assert(a.type==POSTL_NUM);
 				res.type=POSTL_NUM;
 				res.numv=a.numv<b.numv;
 			}
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
-			postl_stackval_release(b);
+			stack_push(prog,res);
+			value_release(a);
+			value_release(b);
 			break;
 
 		case BI_NOT: STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
+			a=stack_pop(prog);
 			b.type=POSTL_NUM;
 			b.numv=!istruthy(a);
-			postl_stackval_release(a);
-			postl_stack_push(prog,b);
+			value_release(a);
+			stack_push(prog,b);
+			break;
+
+		case BI_PRINT: STACKSIZE_CHECK(1);
+			a=stack_pop(prog);
+			printstackval(prog,a,false);
+			value_release(a);
+			break;
+
+		case BI_LF:
+			out_char(&prog->out,'\n');
+			break;
+
+		case BI_FLUSH:
+			out_flush(&prog->out);
+			break;
+
+		case BI_GETC:
+			if(in_want(&prog->in,1)==0)stack_push(prog,value_num(-1));
+			else stack_push(prog,value_str(char_str(prog,prog->in.buf[prog->in.pos++])));
 			break;
 
-		case BI_PRINT: STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
-			printstackval(a,false);
-			postl_stackval_release(a);
+		case BI_READLINE:{
+			inbuf_t *in=&prog->in;
+			in->full=false; // may be left from an earlier fill
+			const char *nl;
+			int scanned=0;
+			while(!(nl=memchr(in->buf+in->pos+scanned,'\n',in->len-in->pos-scanned))){
+				scanned=in->len-in->pos;
+				if(!in_fill(in))break;
+			}
+			if(in->full)RETURN_WITH_ERROR("postl: Input too long in '%s'",name);
+			int linelen=nl?nl-(in->buf+in->pos):in->len-in->pos;
+			if(!nl&&linelen==0){
+				stack_push(prog,value_num(-1));
+				break;
+			}
+			stack_push(prog,value_str(str_make(in->buf+in->pos,linelen)));
+			in->pos+=linelen+(nl?1:0);
+			break;
+		}
+
+		case BI_READ:{ STACKSIZE_CHECK(1);
+			a=stack_pop(prog);
+			if(a.type!=POSTL_NUM||a.numv<0||a.numv>(1<<30)||(int)a.numv!=a.numv){
+				value_release(a);
+				RETURN_WITH_ERROR("postl: Invalid byte count in 'read'");
+			}
+			int n=a.numv;
+			int avail=in_want(&prog->in,n);
+			if(avail==0&&n>0){
+				stack_push(prog,value_num(-1));
+				break;
+			}
+			if(n>avail)n=avail;
+			stack_push(prog,value_str(str_make(prog->in.buf+prog->in.pos,n)));
+			prog->in.pos+=n;
 			break;
+		}
 
-		case BI_LF:
-			putchar('\n');
+		case BI_READALL:{
+			inbuf_t *in=&prog->in;
+			while(in_fill(in));
+			if(in->full)RETURN_WITH_ERROR("postl: Input too long in '%s'",name);
+			stack_push(prog,value_str(str_make(in->buf+in->pos,in->len-in->pos)));
+			in->pos=in->len;
 			break;
+		}
 
-		case BI_GETC:{
-			char c=getchar();
-			if(feof(stdin)){
-				res.type=POSTL_NUM;
-				res.numv=-1;
+		case BI_READNUM:{
+			// Pushes the next whitespace-separated number and 1, or just 0 at the end
+			// of the input
+			inbuf_t *in=&prog->in;
+			in->full=false;
+			for(;;){
+				while(in->pos<in->len&&(CHARCLASS(in->buf[in->pos])&CC_SPACE))in->pos++;
+				if(in->pos<in->len||!in_fill(in))break;
+			}
+			if(in->pos==in->len){
+				stack_push(prog,value_num(0));
+				break;
+			}
+			int toklen=0;
+			for(;;){
+				while(in->pos+toklen<in->len&&!(CHARCLASS(in->buf[in->pos+toklen])&CC_SPACE))toklen++;
+				if(in->pos+toklen<in->len||!in_fill(in))break;
+			}
+			if(in->full)RETURN_WITH_ERROR("postl: Input too long in '%s'",name);
+			const char *tok=in->buf+in->pos;
+			double nval=0;
+			int i=tok[0]=='-';
+			for(;i<toklen&&i<16&&(CHARCLASS(tok[i])&CC_DIGIT);i++)nval=10*nval+(tok[i]-'0');
+			if(i==toklen&&toklen>(tok[0]=='-')){
+				if(tok[0]=='-')nval=-nval;
 			} else {
-				res.type=POSTL_STR;
-				res.strv=malloc(2,char);
-				if(!res.strv)outofmem();
-				res.strv[0]=c;
-				res.strv[1]='\0';
+				char numbuf[64],*endp;
+				if(toklen>=(int)sizeof(numbuf)){
+					RETURN_WITH_ERROR("postl: Invalid number in input in 'readnum'");
+				}
+				memcpy(numbuf,tok,toklen);
+				numbuf[toklen]='\0';
+				nval=strtod(numbuf,&endp);
+				if(isnan(nval)||isinf(nval)||endp-numbuf!=toklen){
+					RETURN_WITH_ERROR("postl: Invalid number in input in 'readnum'");
+				}
 			}
-			postl_stack_push(prog,res);
+			in->pos+=toklen;
+			stack_push(prog,value_num(nval));
+			stack_push(prog,value_num(1));
 			break;
 		}
 
-		case BI_BLOCKOPEN:
-			assert(!prog->buildblock);
-			code_t *bb=prog->buildblock=malloc(1,code_t);
-			if(!bb)outofmem();
-			bb->sz=128;
-			bb->len=1;  // for the scopeenter
-			bb->tokens=malloc(bb->sz,token_t);
-			if(!bb->tokens)outofmem();
-			bb->tokens[0].type=TT_WORD;
-			asprintf(&bb->tokens[0].str,"scopeenter");
-			if(!bb->tokens[0].str)outofmem();
-			prog->blockdepth=1;
-			break;
-
 		case BI_DEF:
 		case BI_GDEF:{
 			STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
-			a=postl_stack_pop(prog);
+			b=stack_pop(prog);
+			a=stack_pop(prog);
 			if(b.type!=POSTL_STR){
-				postl_stackval_release(a);
-				postl_stackval_release(b);
+				value_release(a);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Second argument to '%s' should be string, is %s",
 					name,valtype_string(b.type));
 			}
-			int h=namehash(b.strv);
+			int sym=symbol_intern_n(&prog->syms,b.strv->data,b.strv->len);
+			funcmap_llitem_t *cur=funcmap_lookup(prog,sym);
+			int topscope=prog->nscopes-1;
 
 			bool thisscope=true; // Whether this name is in the top scope; if so, we need to delete it
 			                     // upon setting the new value
-			if(prog->scopestack&&lli->id==BI_DEF){ // gdef does *not* check scoping
-				name_llitem_t *nlli=prog->scopestack->vars[h];
-				while(nlli){
-					if(strcmp(nlli->name,b.strv)==0)break;
-					nlli=nlli->next;
-				}
-				thisscope=(bool)nlli;
+			if(topscope>=0&&id==BI_DEF){ // gdef does *not* check scoping
+				thisscope=cur&&cur->scope==topscope;
 			}
 
-			DBGF("[%s]: b.strv='%s'; thisscope=%d\n",name,b.strv,thisscope);
+			DBGF("[%s]: b.strv='%.*s'; thisscope=%d\n",name,b.strv->len,b.strv->data,thisscope);
+			value_release(b);
+			int scope=-1;
 			if(thisscope){
-				// Lookup the name in the function table, it might still need to be deleted
-				funcmap_llitem_t *lli=prog->fmap[h],*parent=NULL;
-				while(lli){
-					if(strcmp(lli->item.name,b.strv)==0)break;
-					parent=lli;
-					lli=lli->next;
-				}
-				if(lli){
-					if(parent)parent->next=lli->next;
-					else prog->fmap[h]=lli->next;
-					funcmap_item_release(lli->item);
-					free(lli);
-				}
-			} else if(prog->scopestack){
+				// The name might still be in the function table, in which case it needs to be deleted;
+				// the new value takes over its place in the scopes
+				if(cur)scope=cur->scope;
+				deletefunction(prog,sym);
+			} else {
 				// The name was not declared in this scope, and we're not in global scope; add
-				// the name to the scope's var list
-				name_llitem_t *nlli=malloc(1,name_llitem_t);
-				if(!nlli)outofmem();
-				asprintf(&nlli->name,"%s",b.strv);
-				if(!nlli->name)outofmem();
-				nlli->next=prog->scopestack->vars[h];
-				prog->scopestack->vars[h]=nlli;
+				// the name to the scope's part of the log
+				if(prog->scopeloglen==prog->scopelogcap){
+					prog->scopelogcap*=2;
+					prog->scopelog=realloc(prog->scopelog,prog->scopelogcap,int);
+					if(!prog->scopelog)outofmem();
+				}
+				prog->scopelog[prog->scopeloglen++]=sym;
+				scope=topscope;
 			}
 
-			if(a.type!=POSTL_BLOCK){
-				if(a.type!=POSTL_NUM&&a.type!=POSTL_STR){
-					postl_stackval_release(a);
-					postl_stackval_release(b);
-					RETURN_WITH_ERROR("postl: [DBG] Invalid a.type in BI_DEF: %d",a.type);
-				}
-				funcmap_llitem_t *lli=malloc(1,funcmap_llitem_t);
-				if(!lli)outofmem();
-				lli->item.name=b.strv;
-				lli->item.cfunc=NULL;
-				lli->item.code.sz=1;
-				lli->item.code.len=1;
-				lli->item.code.tokens=malloc(1,token_t);
-				if(!lli->item.code.tokens)outofmem();
-				token_t *token=lli->item.code.tokens;
-				switch(a.type){
-					case POSTL_NUM:
-						token->type=TT_NUM;
-						asprintf(&token->str,"%lf",a.numv);
-						if(!token->str)outofmem();
-						break;
-
-					case POSTL_STR:
-						token->type=TT_STR;
-						asprintf(&token->str,"%s",a.strv);
-						if(!token->str)outofmem();
-						break;
-
-					default:
-						assert(false);
-				}
-				lli->next=prog->fmap[h];
-				prog->fmap[h]=lli;
+			funcmap_llitem_t *lli=pool_alloc(&prog->fmappool);
+			lli->scope=scope;
+			lli->frozen=false;
+			lli->item.sym=sym;
+			lli->item.cfunc=NULL;
+			if(a.type==POSTL_BLOCK){
+				lli->item.code=a.blockv; // takes over the stack value's reference
+				lli->item.isvar=false;
 			} else {
-				funcmap_llitem_t *lli=malloc(1,funcmap_llitem_t);
-				if(!lli)outofmem();
-				lli->item.name=b.strv;
-				lli->item.cfunc=NULL;
-				lli->item.code=*a.blockv;
-				lli->next=prog->fmap[h];
-				prog->fmap[h]=lli;
+				lli->item.code=NULL;
+				lli->item.isvar=true;
+				lli->item.val=a;
 			}
-			//postl_stackval_release(a); //values were copied to function definition
-			//postl_stackval_release(b);
+			funcmap_push(prog,lli);
+			//value_release(a); //value was moved into the function map
 			break;
 		}
 
 		case BI_EVAL: STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=POSTL_BLOCK){
-				postl_stackval_release(a);
+				value_release(a);
 				CANNOT_USE(a.type);
 			}
-			const char *errstr=execute_block(prog,*a.blockv);
-			postl_stackval_release(a);
-			if(errstr)return errstr;
+			frame_push(prog,a.blockv,false); // takes over the stack value's reference
 			break;
 
 		case BI_BUILTIN:{ STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=POSTL_STR){
-				postl_stackval_release(a);
+				value_release(a);
 				CANNOT_USE(a.type);
 			}
-			if(strcmp(a.strv,"{")==0||strcmp(a.strv,"}")==0)
+			if(a.strv->len==1&&(a.strv->data[0]=='{'||a.strv->data[0]=='}')){
+				value_release(a);
 				return "Cannot call builtins '{' and '}' via builtin 'builtin'";
-			bool found=false;
-			const char *errstr=execute_builtin(prog,a.strv,&found);
-			postl_stackval_release(a);
+			}
+			int bi=builtin_find(a.strv->data,a.strv->len,namehash(a.strv->data,a.strv->len));
+			if(bi==-1){
+				snprintf(prog->errbuf,sizeof(prog->errbuf),"postl: Builtin '%.*s' not found in builtin 'builtin'",
+					a.strv->len,a.strv->data);
+				value_release(a);
+				return prog->errbuf;
+			}
+			value_release(a);
+			const char *errstr=execute_builtin(prog,bi);
 			if(errstr)return errstr;
-			if(!found)
-				RETURN_WITH_ERROR("postl: Builtin '%s' not found in builtin 'builtin'",
-					a.strv);
 			break;
 		}
 
 		case BI_SWAP:{ STACKSIZE_CHECK(2);
-			stackitem_t *bsi=prog->stack,*asi=bsi->next;
-			bsi->next=asi->next;
-			asi->next=bsi;
-			prog->stack=asi;
+			value_t *top=prog->stack+prog->stacksz-1;
+			value_t tmp=top[0];
+			top[0]=top[-1];
+			top[-1]=tmp;
 			break;
 		}
 
 		case BI_DUP: STACKSIZE_CHECK(1);
-			postl_stack_push(prog,prog->stack->val);
+			stack_push(prog,value_copy(prog->stack[prog->stacksz-1]));
 			break;
 
 		case BI_POP: STACKSIZE_CHECK(1);
-			postl_stackval_release(postl_stack_pop(prog));
+			value_release(stack_pop(prog));
 			break;
 
 		// positive roll amount *extracts* elements from the stack bottom
@@ -874,33 +2415,33 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 		// rotate: first cycle length, then rotation amount
 		case BI_ROLL:
 		case BI_ROTATE:{
-			STACKSIZE_CHECK(1+(lli->id==BI_ROTATE));
-			b=postl_stack_pop(prog);
+			STACKSIZE_CHECK(1+(id==BI_ROTATE));
+			b=stack_pop(prog);
 			if(b.type!=POSTL_NUM){
-				postl_stackval_release(b);
+				value_release(b);
 				CANNOT_USE(b.type);
 			}
 			if((double)(int)b.numv!=b.numv){
-				postl_stackval_release(b);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Argument to '%s' not integral",name);
 			}
 			int bnum=b.numv;
-			postl_stackval_release(b);
+			value_release(b);
 			int length;
 			int stacksize;
-			if(lli->id==BI_ROTATE){
-				a=postl_stack_pop(prog);
+			if(id==BI_ROTATE){
+				a=stack_pop(prog);
 				stacksize=prog->stacksz;
 				if(a.type!=POSTL_NUM){
-					postl_stackval_release(a);
+					value_release(a);
 					CANNOT_USE(a.type);
 				}
 				if((double)(int)a.numv!=a.numv){
-					postl_stackval_release(a);
+					value_release(a);
 					RETURN_WITH_ERROR("postl: Argument to 'rotate' not integral");
 				}
 				length=a.numv;
-				postl_stackval_release(a);
+				value_release(a);
 				if(length<0)
 					RETURN_WITH_ERROR("postl: First argument to 'rotate' negative");
 				if(length>stacksize)
@@ -915,82 +2456,69 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 			if(amount<0)amount=length+amount;
 			DBGF("ssize=%d length=%d amount=%d",stacksize,length,amount);
 
-			stackitem_t *newbot=prog->stack;
-			for(int i=0;i<length-amount-1;i++)newbot=newbot->next;
-			stackitem_t *newtop=newbot->next;
-			assert(newtop);  // because amount>0
-			stackitem_t *bottom=newtop;
-			for(int i=0;i<amount-1;i++)bottom=bottom->next;
-			newbot->next=bottom->next;
-			bottom->next=prog->stack;
-			prog->stack=newtop;
+			// The bottom 'amount' items of the top 'length' items move to the top,
+			// i.e. a left rotation of that slice of the array
+			value_t *slice=prog->stack+prog->stacksz-length;
+			reverse_stackvals(slice,amount);
+			reverse_stackvals(slice+amount,length-amount);
+			reverse_stackvals(slice,length);
 			break;
 		}
 
 		case BI_IF:
 		case BI_WHILE:{
 			STACKSIZE_CHECK(2);
-			postl_stackval_t body=postl_stack_pop(prog);
+			value_t body=stack_pop(prog);
 			if(body.type!=POSTL_BLOCK){
-				postl_stackval_release(body);
+				value_release(body);
 				RETURN_WITH_ERROR("postl: Argument to '%s' should be block, is %s",
 					name,valtype_string(body.type));
 			}
-			while(true){
-				postl_stackval_t cond=postl_stack_pop(prog);
-				bool stop=!istruthy(cond);
-				postl_stackval_release(cond);
-				if(stop)break;
-				const char *errstr=execute_block(prog,*body.blockv);
-				if(errstr){
-					postl_stackval_release(body);
-					return errstr;
-				}
-				if(lli->id==BI_IF)break;
-			}
-			postl_stackval_release(body);
+			value_t cond=stack_pop(prog);
+			bool condval=istruthy(cond);
+			value_release(cond);
+			if(condval)frame_push(prog,body.blockv,id==BI_WHILE);
+			else value_release(body);
 			break;
 		}
 
 		case BI_IFELSE:{ STACKSIZE_CHECK(3);
-			postl_stackval_t elsebl=postl_stack_pop(prog);
+			value_t elsebl=stack_pop(prog);
 			if(elsebl.type!=POSTL_BLOCK){
-				postl_stackval_release(elsebl);
+				value_release(elsebl);
 				RETURN_WITH_ERROR("postl: Third argument to 'ifelse' should be block, is %s",
 					valtype_string(elsebl.type));
 			}
-			postl_stackval_t thenbl=postl_stack_pop(prog);
+			value_t thenbl=stack_pop(prog);
 			if(thenbl.type!=POSTL_BLOCK){
-				postl_stackval_release(elsebl);
-				postl_stackval_release(thenbl);
+				value_release(elsebl);
+				value_release(thenbl);
 				RETURN_WITH_ERROR("postl: Second argument to 'ifelse' should be block, is %s",
 					valtype_string(thenbl.type));
 			}
-			postl_stackval_t cond=postl_stack_pop(prog);
+			value_t cond=stack_pop(prog);
 			bool condval=istruthy(cond);
-			postl_stackval_release(cond);
-			const char *errstr;
+			value_release(cond);
 			if(condval){
-				errstr=execute_block(prog,*thenbl.blockv);
+				frame_push(prog,thenbl.blockv,false);
+				value_release(elsebl);
 			} else {
-				errstr=execute_block(prog,*elsebl.blockv);
+				frame_push(prog,elsebl.blockv,false);
+				value_release(thenbl);
 			}
-			postl_stackval_release(thenbl);
-			postl_stackval_release(elsebl);
-			if(errstr)return errstr;
 			break;
 		}
 
 		case BI_STACKSIZE:
-			postl_stack_push(prog,postl_stackval_makenum(postl_stack_size(prog)));
+			stack_push(prog,value_num(prog->stacksz));
 			break;
 
 		case BI_STACKDUMP:
-			for(stackitem_t *si=prog->stack;si;si=si->next){
-				printstackval(si->val,true);
-				if(si->next)printf("  ");
+			for(int i=prog->stacksz-1;i>=0;i--){
+				printstackval(prog,prog->stack[i],true);
+				if(i>0)out_str(&prog->out,"  ");
 			}
-			putchar('\n');
+			out_char(&prog->out,'\n');
 			break;
 
 		UNARY_ARITH_OP(BI_CEIL,ceil(a.numv))
@@ -1012,141 +2540,118 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 		BINARY_ARITH_OP(BI_ATAN2,atan2(a.numv,b.numv))
 
 		case BI_E:
-			postl_stack_push(prog,postl_stackval_makenum(M_E));
+			stack_push(prog,value_num(M_E));
 			break;
 
 		case BI_PI:
-			postl_stack_push(prog,postl_stackval_makenum(M_PI));
+			stack_push(prog,value_num(M_PI));
 			break;
 
 		case BI_STRIDX:{ STACKSIZE_CHECK(2);
-			b=postl_stack_pop(prog);
+			b=stack_pop(prog);
 			if(b.type!=POSTL_NUM||(int)b.numv!=b.numv){
-				postl_stackval_release(b);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Second argument to 'stridx' should be integer, is %s",
 					valtype_string(b.type));
 			}
 			int idx=b.numv;
-			postl_stackval_release(b);
-			a=prog->stack->val;
+			value_release(b);
+			a=prog->stack[prog->stacksz-1];
 			if(a.type!=POSTL_STR){
 				RETURN_WITH_ERROR("postl: First argument to 'stridx' should be string, is %s",
 					valtype_string(a.type));
 			}
-			if(idx<0||idx>=(int)strlen(a.strv)){
+			if(idx<0||idx>=a.strv->len){
 				RETURN_WITH_ERROR("postl: String index out of range in 'stridx'");
 			}
-			res.type=POSTL_STR;
-			res.strv=malloc(2,char);
-			if(!res.strv)outofmem();
-			res.strv[0]=a.strv[idx];
-			res.strv[1]='\0';
-			postl_stack_push(prog,res);
+			stack_push(prog,value_str(char_str(prog,a.strv->data[idx])));
 			break;
 		}
 
 		case BI_SUBSTR:{ STACKSIZE_CHECK(3);
-			b=postl_stack_pop(prog);
+			b=stack_pop(prog);
 			if(b.type!=POSTL_NUM||(int)b.numv!=b.numv){
-				postl_stackval_release(b);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Third argument to 'substr' should be integer, is %s",
 					valtype_string(b.type));
 			}
 			int length=b.numv;
-			postl_stackval_release(b);
-			b=postl_stack_pop(prog);
+			value_release(b);
+			b=stack_pop(prog);
 			if(b.type!=POSTL_NUM||(int)b.numv!=b.numv){
-				postl_stackval_release(b);
+				value_release(b);
 				RETURN_WITH_ERROR("postl: Second argument to 'substr' should be integer, is %s",
 					valtype_string(b.type));
 			}
 			int start=b.numv;
-			postl_stackval_release(b);
-			a=prog->stack->val;
+			value_release(b);
+			a=prog->stack[prog->stacksz-1];
 			if(a.type!=POSTL_STR){
 				RETURN_WITH_ERROR("postl: First argument to 'substr' should be string, is %s",
 					valtype_string(a.type));
 			}
-			int slen=strlen(a.strv);
+			int slen=a.strv->len;
 			if(start<0||start>=slen||length<0){
 				RETURN_WITH_ERROR("postl: Index out of range or length invalid in 'substr'");
 			}
 			if(start+length>slen)length=slen-start;
-			res.type=POSTL_STR;
-			res.strv=malloc(length+1,char);
-			if(!res.strv)outofmem();
-			memcpy(res.strv,a.strv+start,length);
-			res.strv[length]='\0';
-			postl_stack_push(prog,res);
+			stack_push(prog,value_str(str_slice(a.strv,start,length)));
 			break;
 		}
 
 		case BI_STRLEN: STACKSIZE_CHECK(1);
-			a=prog->stack->val;
+			a=prog->stack[prog->stacksz-1];
 			if(a.type!=POSTL_STR)CANNOT_USE(a.type);
 			res.type=POSTL_NUM;
-			res.numv=strlen(a.strv);
-			postl_stack_push(prog,res);
+			res.numv=a.strv->len;
+			stack_push(prog,res);
 			break;
 
-		case BI_CHR: STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
+		case BI_CHR:{ STACKSIZE_CHECK(1);
+			a=stack_pop(prog);
 			if(a.type!=POSTL_NUM)CANNOT_USE(a.type);
-			res.type=POSTL_STR;
-			res.strv=malloc(2,char);
-			if(!res.strv)outofmem();
-			res.strv[0]=((int)a.numv%256+256)%256;
-			res.strv[1]='\0';
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
+			stack_push(prog,value_str(char_str(prog,((int)a.numv%256+256)%256)));
+			value_release(a);
 			break;
+		}
 
 		case BI_ORD: STACKSIZE_CHECK(1);
-			a=postl_stack_pop(prog);
+			a=stack_pop(prog);
 			if(a.type!=POSTL_STR)CANNOT_USE(a.type);
-			if(strlen(a.strv)==0){
-				postl_stackval_release(a);
+			if(a.strv->len==0){
+				value_release(a);
 				RETURN_WITH_ERROR("postl: String argument empty in 'ord'");
 			}
 			res.type=POSTL_NUM;
-			res.numv=(unsigned char)a.strv[0];
-			postl_stack_push(prog,res);
-			postl_stackval_release(a);
+			res.numv=(unsigned char)a.strv->data[0];
+			stack_push(prog,res);
+			value_release(a);
+			break;
+
+		case BI_STRBUF: STACKSIZE_CHECK(1);
+			a=stack_pop(prog);
+			if(a.type!=POSTL_NUM||a.numv<0||a.numv>(1<<30)||(int)a.numv!=a.numv){
+				value_release(a);
+				RETURN_WITH_ERROR("postl: Invalid capacity in 'strbuf'");
+			}
+			// an empty string with room to be appended to without reallocating
+			stack_push(prog,value_str(str_alloc(a.numv)));
 			break;
 
-		case BI_SCOPEENTER:{
-			scope_frame_t *frame=malloc(1,scope_frame_t);
-			if(!frame)outofmem();
-			for(int h=0;h<HASHMAP_SIZE;h++)frame->vars[h]=NULL;
-			frame->next=prog->scopestack;
-			prog->scopestack=frame;
+		case BI_SCOPEENTER:
+			scope_enter(prog);
 			break;
-		}
 
-		case BI_SCOPELEAVE:{
-			scope_frame_t *frame=prog->scopestack;
-			if(!frame){
-				snprintf(errbuf,256,"postl: scopeleave on empty scope stack");
-				return errbuf;
-			}
-			prog->scopestack=frame->next;
-			for(int h=0;h<HASHMAP_SIZE;h++){
-				DBG(if(frame->vars[h])DBGF("h=%d:",h);)
-				while(frame->vars[h]){
-					DBGF("- '%s'",frame->vars[h]->name);
-					deletefunction(prog,frame->vars[h]->name);
-					free(frame->vars[h]->name);
-					name_llitem_t *next=frame->vars[h]->next;
-					free(frame->vars[h]);
-					frame->vars[h]=next;
-				}
+		case BI_SCOPELEAVE:
+			if(!scope_leave(prog)){
+				snprintf(prog->errbuf,sizeof(prog->errbuf),"postl: scopeleave on empty scope stack");
+				return prog->errbuf;
 			}
 			break;
-		}
 
 		default:
-			snprintf(errbuf,256,"postl: Sorry, not implemented: builtin '%s'",name);
-			return errbuf;
+			snprintf(prog->errbuf,sizeof(prog->errbuf),"postl: Sorry, not implemented: builtin '%s'",name);
+			return prog->errbuf;
 
 
 #undef UNARY_ARITH_OP
@@ -1162,73 +2667,451 @@ static const char* execute_builtin(postl_program_t *prog,const char *name,bool *
 }
 
 
+// Snapshots: the strings, code units and function map items reachable from a
+// program's state are frozen into a set that the program, the snapshot and
+// every program made from it keep alive. Frozen objects aren't refcounted and
+// never change, so programs on different threads can share them; making a
+// program from a snapshot only copies the tables that refer to them.
+typedef struct frozen_t{
+	int refcount; // changed atomically
+	struct frozen_t *parent; // the program's previous set, which objects here may refer to
+	arena_t arena; // function map items and symbol names
+	str_t **strs;
+	int nstrs,strscap;
+	codeunit_t **units;
+	int nunits,unitscap;
+} frozen_t;
+
+struct postl_snapshot_t{
+	frozen_t *frozen;
+	value_t *stack;
+	int stacksz;
+	funcmap_slot_t *fmap;
+	int fmapsz,fmapused;
+	int builtinbound[NUM_BUILTINS];
+	symbol_t *syms;
+	int nsyms;
+	int *symindex;
+	int symindexsz;
+	int *scopelog,scopeloglen;
+	int *scopestack,nscopes;
+	postl_output_func_t sink;
+	void *sinkctx;
+	postl_input_func_t source;
+	void *sourcectx;
+};
+
+static void* memdup(const void *p,size_t n){
+	void *copy=malloc(n>0?n:1,char);
+	if(!copy)outofmem();
+	memcpy(copy,p,n);
+	return copy;
+}
+
+static void frozen_retain(frozen_t *fz){
+	__atomic_add_fetch(&fz->refcount,1,__ATOMIC_RELAXED);
+}
+
+static void frozen_release(frozen_t *fz){
+	while(fz&&__atomic_sub_fetch(&fz->refcount,1,__ATOMIC_ACQ_REL)==0){
+		// Frozen objects are freed without looking at what they refer to, which
+		// is frozen too
+		for(int i=0;i<fz->nstrs;i++)free(fz->strs[i]);
+		free(fz->strs);
+		for(int i=0;i<fz->nunits;i++){
+			free(fz->units[i]->strs);
+			arena_destroy(&fz->units[i]->arena);
+			free(fz->units[i]);
+		}
+		free(fz->units);
+		arena_destroy(&fz->arena);
+		frozen_t *parent=fz->parent;
+		free(fz);
+		fz=parent;
+	}
+}
+
+static void freeze_str(frozen_t *fz,str_t *str){
+	for(;str&&str->refcount>=0;str=str->base){
+		str->refcount=-1;
+		if(fz->nstrs==fz->strscap){
+			fz->strscap=fz->strscap==0?16:2*fz->strscap;
+			fz->strs=realloc(fz->strs,fz->strscap,str_t*);
+			if(!fz->strs)outofmem();
+		}
+		fz->strs[fz->nstrs++]=str;
+	}
+}
+
+static void freeze_unit(frozen_t *fz,codeunit_t *unit){
+	if(unit->refcount<0)return;
+	unit->refcount=-1;
+	if(fz->nunits==fz->unitscap){
+		fz->unitscap=fz->unitscap==0?16:2*fz->unitscap;
+		fz->units=realloc(fz->units,fz->unitscap,codeunit_t*);
+		if(!fz->units)outofmem();
+	}
+	fz->units[fz->nunits++]=unit;
+	for(int i=0;i<unit->nstrs;i++)freeze_str(fz,unit->strs[i]);
+}
+
+static void freeze_value(frozen_t *fz,value_t val){
+	if(val.type==POSTL_STR)freeze_str(fz,val.strv);
+	else if(val.type==POSTL_BLOCK)freeze_unit(fz,val.blockv->unit);
+}
+
+postl_snapshot_t* postl_snapshot(postl_program_t *prog){
+	DBGF("postl_snapshot(%p)",prog);
+	out_flush(&prog->out);
+	frozen_t *fz=malloc(1,frozen_t);
+	if(!fz)outofmem();
+	fz->refcount=2; // the program and the snapshot
+	fz->parent=prog->frozen; // takes over the program's reference
+	arena_init(&fz->arena);
+	fz->strs=NULL;
+	fz->nstrs=fz->strscap=0;
+	fz->units=NULL;
+	fz->nunits=fz->unitscap=0;
+	prog->frozen=fz;
+
+	for(int i=0;i<prog->stacksz;i++)freeze_value(fz,prog->stack[i]);
+	for(int i=0;i<prog->fmapsz;i++){
+		if(prog->fmap[i].sym==-1)continue;
+		// The program's own items are above any frozen ones
+		funcmap_llitem_t **link=&prog->fmap[i].bindings;
+		while(*link&&!(*link)->frozen){
+			funcmap_llitem_t *lli=*link;
+			funcmap_llitem_t *copy=arena_alloc(&fz->arena,sizeof(funcmap_llitem_t));
+			*copy=*lli;
+			copy->frozen=true;
+			if(copy->item.code)freeze_unit(fz,copy->item.code->unit);
+			if(copy->item.isvar)freeze_value(fz,copy->item.val);
+			*link=copy;
+			pool_free(&prog->fmappool,lli);
+			link=&copy->next;
+		}
+	}
+	symtab_t *st=&prog->syms;
+	for(int i=st->nfrozen;i<st->nsyms;i++){
+		const char *name=copy_slice(&fz->arena,st->syms[i].name,st->syms[i].len);
+		free((char*)st->syms[i].name);
+		st->syms[i].name=name;
+	}
+	st->nfrozen=st->nsyms;
+
+	postl_snapshot_t *snap=malloc(1,postl_snapshot_t);
+	if(!snap)outofmem();
+	snap->frozen=fz;
+	snap->stack=memdup(prog->stack,prog->stacksz*sizeof(value_t));
+	snap->stacksz=prog->stacksz;
+	snap->fmap=memdup(prog->fmap,prog->fmapsz*sizeof(funcmap_slot_t));
+	snap->fmapsz=prog->fmapsz;
+	snap->fmapused=prog->fmapused;
+	memcpy(snap->builtinbound,prog->builtinbound,sizeof(snap->builtinbound));
+	snap->syms=memdup(st->syms,st->nsyms*sizeof(symbol_t));
+	snap->nsyms=st->nsyms;
+	snap->symindex=memdup(st->index,st->indexsz*sizeof(int));
+	snap->symindexsz=st->indexsz;
+	snap->scopelog=memdup(prog->scopelog,prog->scopeloglen*sizeof(int));
+	snap->scopeloglen=prog->scopeloglen;
+	snap->scopestack=memdup(prog->scopestack,prog->nscopes*sizeof(int));
+	snap->nscopes=prog->nscopes;
+	snap->sink=prog->out.sink;
+	snap->sinkctx=prog->out.ctx;
+	snap->source=prog->in.source;
+	snap->sourcectx=prog->in.ctx;
+	return snap;
+}
+
+void postl_restore(postl_program_t *prog,const postl_snapshot_t *snap){
+	DBGF("postl_restore(%p,%p)",prog,snap);
+	out_flush(&prog->out);
+
+	// Drop the current state; frozen objects are still alive here
+	frames_unwind(prog,0);
+	while(prog->stacksz>0)value_release(prog->stack[--prog->stacksz]);
+	// Cached characters may have been frozen into the state that's released below
+	for(int i=0;i<256;i++){
+		if(prog->chars[i])str_release(prog->chars[i]);
+		prog->chars[i]=NULL;
+	}
+	for(int i=0;i<prog->fmapsz;i++){
+		if(prog->fmap[i].sym==-1)continue;
+		for(funcmap_llitem_t *lli=prog->fmap[i].bindings;lli;lli=lli->next)funcmap_item_release(lli->item);
+	}
+	pool_destroy(&prog->fmappool);
+	pool_init(&prog->fmappool,sizeof(funcmap_llitem_t));
+	free(prog->fmap);
+	symtab_t *st=&prog->syms;
+	for(int i=st->nfrozen;i<st->nsyms;i++)free((char*)st->syms[i].name);
+	free(st->syms);
+	free(st->index);
+#ifdef POSTL_PROFILE
+	// The profile may refer to code that's about to go
+	for(int i=0;i<prog->profile.sz;i++){
+		if(prog->profile.entries[i].code)code_release(prog->profile.entries[i].code);
+	}
+	memset(prog->profile.entries,0,prog->profile.sz*sizeof(profile_entry_t));
+	prog->profile.used=0;
+	prog->profile.ninstrs=0;
+#endif
+
+	if(snap->stacksz>prog->stackcap){
+		prog->stackcap=snap->stacksz;
+		prog->stack=realloc(prog->stack,prog->stackcap,value_t);
+		if(!prog->stack)outofmem();
+	}
+	memcpy(prog->stack,snap->stack,snap->stacksz*sizeof(value_t)); // frozen, so not retained
+	prog->stacksz=snap->stacksz;
+	prog->fmap=memdup(snap->fmap,snap->fmapsz*sizeof(funcmap_slot_t));
+	prog->fmapsz=snap->fmapsz;
+	prog->fmapused=snap->fmapused;
+	memcpy(prog->builtinbound,snap->builtinbound,sizeof(prog->builtinbound));
+	st->syms=memdup(snap->syms,snap->nsyms*sizeof(symbol_t));
+	st->nsyms=st->cap=st->nfrozen=snap->nsyms;
+	st->index=memdup(snap->symindex,snap->symindexsz*sizeof(int));
+	st->indexsz=snap->symindexsz;
+	if(snap->scopeloglen>prog->scopelogcap){
+		prog->scopelogcap=snap->scopeloglen;
+		prog->scopelog=realloc(prog->scopelog,prog->scopelogcap,int);
+		if(!prog->scopelog)outofmem();
+	}
+	memcpy(prog->scopelog,snap->scopelog,snap->scopeloglen*sizeof(int));
+	prog->scopeloglen=snap->scopeloglen;
+	if(snap->nscopes>prog->scopestackcap){
+		prog->scopestackcap=snap->nscopes;
+		prog->scopestack=realloc(prog->scopestack,prog->scopestackcap,int);
+		if(!prog->scopestack)outofmem();
+	}
+	memcpy(prog->scopestack,snap->scopestack,snap->nscopes*sizeof(int));
+	prog->nscopes=snap->nscopes;
+
+	frozen_retain(snap->frozen);
+	frozen_release(prog->frozen);
+	prog->frozen=snap->frozen;
+}
+
+postl_program_t* postl_snapshot_makeprogram(const postl_snapshot_t *snap){
+	DBGF("postl_snapshot_makeprogram(%p)",snap);
+	postl_program_t *prog=postl_makeprogram();
+	prog->out.sink=snap->sink;
+	prog->out.ctx=snap->sinkctx;
+	prog->in.source=snap->source;
+	prog->in.ctx=snap->sourcectx;
+	postl_restore(prog,snap);
+	return prog;
+}
+
+void postl_snapshot_destroy(postl_snapshot_t *snap){
+	DBGF("postl_snapshot_destroy(%p)",snap);
+	free(snap->stack);
+	free(snap->fmap);
+	free(snap->syms);
+	free(snap->symindex);
+	free(snap->scopelog);
+	free(snap->scopestack);
+	frozen_release(snap->frozen);
+	free(snap);
+}
+
+postl_program_t* postl_program_clone(postl_program_t *prog){
+	DBGF("postl_program_clone(%p)",prog);
+	postl_snapshot_t *snap=postl_snapshot(prog);
+	postl_program_t *clone=postl_snapshot_makeprogram(snap);
+	postl_snapshot_destroy(snap);
+	return clone;
+}
+
 postl_program_t* postl_makeprogram(void){
 	DBGF("postl_makeprogram()");
 	postl_program_t *prog=malloc(1,postl_program_t);
 	if(!prog)outofmem();
-	prog->stack=NULL;
+	prog->stackcap=16;
+	prog->stack=malloc(prog->stackcap,value_t);
+	if(!prog->stack)outofmem();
 	prog->stacksz=0;
-	for(int i=0;i<HASHMAP_SIZE;i++){
-		prog->fmap[i]=NULL;
+	prog->fmapsz=64;
+	prog->fmapused=0;
+	prog->fmap=malloc(prog->fmapsz,funcmap_slot_t);
+	if(!prog->fmap)outofmem();
+	for(int i=0;i<prog->fmapsz;i++){
+		prog->fmap[i].sym=-1;
 	}
-
-	/*for(int i=0;i<HASHMAP_SIZE;i++){
-		prog->vmap[i]=NULL;
-	}*/
-
-	prog->buildblock=NULL;
-	prog->blockdepth=0; //not strictly necessary as buildblock==NULL conveys the message, but still
-
-	prog->scopestack=NULL;
-
-	initialise_builtins_hmap();
+	memset(prog->builtinbound,0,sizeof(prog->builtinbound));
+	pool_init(&prog->fmappool,sizeof(funcmap_llitem_t));
+	arena_init(&prog->scratch);
+
+	prog->scopelogcap=16;
+	prog->scopeloglen=0;
+	prog->scopelog=malloc(prog->scopelogcap,int);
+	if(!prog->scopelog)outofmem();
+	prog->scopestackcap=16;
+	prog->nscopes=0;
+	prog->scopestack=malloc(prog->scopestackcap,int);
+	if(!prog->scopestack)outofmem();
+
+	symtab_init(&prog->syms);
+	prog->frozen=NULL;
+	prog->framescap=16;
+	prog->nframes=0;
+	prog->frames=malloc(prog->framescap,frame_t);
+	if(!prog->frames)outofmem();
+	prog->running=0;
+	memset(&prog->budget,0,sizeof(prog->budget));
+	prog->error=NULL;
+	prog->suspend=false;
+	prog->userdata=NULL;
+	out_init(&prog->out);
+	in_init(&prog->in,&prog->out);
+	memset(prog->chars,0,sizeof(prog->chars));
+
+#ifdef POSTL_PROFILE
+	prog->profile.sz=1024;
+	prog->profile.used=0;
+	prog->profile.ninstrs=0;
+	prog->profile.entries=calloc(prog->profile.sz,sizeof(profile_entry_t));
+	if(!prog->profile.entries)outofmem();
+#endif
 
 	return prog;
 }
 
 void postl_register(postl_program_t *prog,const char *name,void (*func)(postl_program_t*)){
 	DBGF("postl_register(%p,%s,%p)",prog,name,func);
-	int h=namehash(name);
-	int len=strlen(name);
-	funcmap_llitem_t *llitem=malloc(1,funcmap_llitem_t);
-	if(!llitem)outofmem();
-	llitem->item.name=malloc(len+1,char);
-	if(!llitem->item.name)outofmem();
-	memcpy(llitem->item.name,name,len+1);
+	int sym=symbol_intern(&prog->syms,name);
+	prog->syms.syms[sym].cfunc=true;
+	funcmap_llitem_t *llitem=pool_alloc(&prog->fmappool);
+	llitem->scope=-1;
+	llitem->frozen=false;
+	llitem->item.sym=sym;
 	llitem->item.cfunc=func;
-	llitem->item.code.sz=0;
-	llitem->item.code.len=0;
-	llitem->item.code.tokens=NULL;
-	llitem->next=prog->fmap[h];
-	prog->fmap[h]=llitem;
+	llitem->item.code=NULL;
+	llitem->item.isvar=false;
+	funcmap_push(prog,llitem);
 }
 
 const char* postl_runcode(postl_program_t *prog,const char *source){
-	DBGF("postl_runcode(%p,<<<\"%s\">>>)",prog,source);
+	return postl_runcode_n(prog,source,strlen(source));
+}
+
+// maybe returns error string; on success, *codep is the compiled source
+static const char* compile_source(postl_program_t *prog,const char *source,size_t sourcelen,code_t **codep){
+	if(sourcelen>INT_MAX)return "postl: Source code too long";
 	token_t *tokens=NULL;
 	int len=-1;
-	const char *errstr=tokenise(&tokens,source,&len);
-	if(len<0){
+	const char *errstr=tokenise(prog,&tokens,source,sourcelen,&len);
+	if(len<0||errstr){
+		arena_reset(&prog->scratch);
 		if(!errstr)return "postl: Tokenise error? (errstr=NULL)";
 		return errstr;
 	}
-	if(errstr)return errstr;
 	DBG(
 		DBGF("%d tokens parsed",len);
 		for(int i=0;i<len;i++){
-			DBGF("token: type=%d '%s'",tokens[i].type,tokens[i].str);
+			DBGF("token: type=%d '%.*s'",tokens[i].type,tokens[i].len,tokens[i].str);
 		}
 	)
 	assert(tokens);
 
-	errstr=NULL;
-	for(int i=0;i<len;i++){
-		errstr=execute_token(prog,tokens[i]);
-		if(errstr)break;
-	}
-	for(int i=0;i<len;i++)free(tokens[i].str);
+	int idx=0;
+	codeunit_t *unit=codeunit_make();
+	*codep=compile(&prog->syms,unit,tokens,len,&idx,false);
 	free(tokens);
-	assert(!prog->buildblock);
+	arena_reset(&prog->scratch);
+	return NULL;
+}
+
+const char* postl_runcode_n(postl_program_t *prog,const char *source,size_t sourcelen){
+	DBGF("postl_runcode_n(%p,<<<\"%.*s\">>>)",prog,(int)sourcelen,source);
+	code_t *code;
+	const char *errstr=compile_source(prog,source,sourcelen,&code);
+	if(errstr)return errstr;
+	int base=prog->nframes;
+	frame_push(prog,code,false);
+	errstr=run_to_end(prog,base);
+	out_flush(&prog->out);
+	return errstr;
+}
+
+postl_status_t postl_runcode_step(postl_program_t *prog,const char *source,size_t sourcelen){
+	DBGF("postl_runcode_step(%p,<<<\"%.*s\">>>)",prog,(int)sourcelen,source);
+	if(prog->running>0||prog->nframes>0){
+		prog->error="postl: Program is already running code";
+		return POSTL_ERROR;
+	}
+	code_t *code;
+	prog->error=compile_source(prog,source,sourcelen,&code);
+	if(prog->error)return POSTL_ERROR;
+	frame_push(prog,code,false);
+	return postl_resume(prog);
+}
+
+postl_status_t postl_resume(postl_program_t *prog){
+	DBGF("postl_resume(%p)",prog);
+	if(prog->running>0||prog->nframes==0){
+		prog->error=prog->running>0?"postl: Program is already running code":"postl: Nothing to resume";
+		return POSTL_ERROR;
+	}
+	budget_start(&prog->budget);
+	prog->running++;
+	postl_status_t status=run(prog,0);
+	prog->running--;
+	out_flush(&prog->out);
+	return status;
+}
+
+const char* postl_error(postl_program_t *prog){
+	return prog->error;
+}
+
+void postl_abandon(postl_program_t *prog){
+	DBGF("postl_abandon(%p)",prog);
+	if(prog->running==0)frames_unwind(prog,0);
+}
+
+void postl_set_budget(postl_program_t *prog,long maxinstrs,double maxseconds){
+	prog->budget.max=maxinstrs>0?maxinstrs:0;
+	prog->budget.seconds=maxseconds>0?maxseconds:0;
+}
+
+void postl_interrupt(postl_program_t *prog){
+	__atomic_store_n(&prog->budget.interrupted,true,__ATOMIC_RELAXED);
+}
+
+void postl_suspend(postl_program_t *prog){
+	DBGF("postl_suspend(%p)",prog);
+	prog->suspend=true;
+}
+
+void postl_set_userdata(postl_program_t *prog,void *data){
+	prog->userdata=data;
+}
+
+void* postl_userdata(postl_program_t *prog){
+	return prog->userdata;
+}
+
+const char* postl_compilecode(postl_program_t *prog,const char *source,size_t sourcelen,void **imagep,size_t *sizep){
+	DBGF("postl_compilecode(%p,<<<\"%.*s\">>>)",prog,(int)sourcelen,source);
+	code_t *code;
+	const char *errstr=compile_source(prog,source,sourcelen,&code);
+	if(errstr)return errstr;
+	char *image=NULL;
+	errstr=image_save(&prog->syms,code,&image,sizep);
+	code_release(code);
+	if(!errstr)*imagep=image;
+	return errstr;
+}
+
+const char* postl_runcompiled(postl_program_t *prog,const void *image,size_t size){
+	DBGF("postl_runcompiled(%p,%p,%zu)",prog,image,size);
+	code_t *code;
+	const char *errstr=image_load(&prog->syms,image,size,&code);
+	if(errstr)return errstr;
+	int base=prog->nframes;
+	frame_push(prog,code,false);
+	errstr=run_to_end(prog,base);
+	out_flush(&prog->out);
 	return errstr;
 }
 
@@ -1254,41 +3137,27 @@ int postl_stack_size(postl_program_t *prog){
 
 void postl_stack_push(postl_program_t *prog,postl_stackval_t val){
 	DBGF("postl_stack_push(%p,{type=%d,...})",prog,val.type);
-	stackitem_t *si=malloc(1,stackitem_t);
-	if(!si)outofmem();
-	si->val.type=val.type;
-	si->val.numv=val.numv;
-	if(val.type==POSTL_STR){
-		if(val.strv==NULL){
-			fprintf(stderr,"postl: NULL string in stack value to postl_stack_push\n");
-			exit(1);
-		}
-		int len=strlen(val.strv);
-		si->val.strv=malloc(len+1,char);
-		if(!si->val.strv)outofmem();
-		memcpy(si->val.strv,val.strv,len+1);
-	} else si->val.strv=NULL;
-	if(val.type==POSTL_BLOCK){
-		if(val.blockv==NULL){
-			fprintf(stderr,"postl: NULL block in stack value to postl_stack_push\n");
-			exit(1);
-		}
-		code_t *code=malloc(1,code_t);
-		if(!code)outofmem();
-		code->sz=val.blockv->sz;
-		code->len=val.blockv->len;
-		code->tokens=malloc(code->sz,token_t);
-		if(!code->tokens)outofmem();
-		for(int i=0;i<code->len;i++){
-			code->tokens[i].type=val.blockv->tokens[i].type;
-			asprintf(&code->tokens[i].str,"%s",val.blockv->tokens[i].str);
-			if(!code->tokens[i].str)outofmem();
-		}
-		si->val.blockv=code;
-	} else si->val.blockv=NULL;
-	si->next=prog->stack;
-	prog->stack=si;
-	prog->stacksz++;
+	value_t v={.type=val.type};
+	switch(val.type){
+		case POSTL_NUM:
+			v.numv=val.numv;
+			break;
+		case POSTL_STR:
+			if(val.strv==NULL){
+				fprintf(stderr,"postl: NULL string in stack value to postl_stack_push\n");
+				exit(1);
+			}
+			v.strv=str_make(val.strv,strlen(val.strv));
+			break;
+		case POSTL_BLOCK:
+			if(val.blockv==NULL){
+				fprintf(stderr,"postl: NULL block in stack value to postl_stack_push\n");
+				exit(1);
+			}
+			v.blockv=code_retain(val.blockv);
+			break;
+	}
+	stack_push(prog,v);
 }
 
 void postl_stack_pushes(postl_program_t *prog,int nvals,const postl_stackval_t *vals){
@@ -1300,15 +3169,16 @@ void postl_stack_pushes(postl_program_t *prog,int nvals,const postl_stackval_t *
 
 postl_stackval_t postl_stack_pop(postl_program_t *prog){
 	DBGF("postl_stack_pop(%p)",prog);
-	if(prog->stacksz==0){
-		fprintf(stderr,"postl: Stack pop on empty stack!\n");
-		exit(1);
+	value_t v=stack_pop(prog);
+	postl_stackval_t val={.type=v.type,.numv=0,.strv=NULL,.blockv=NULL};
+	switch(v.type){
+		case POSTL_NUM: val.numv=v.numv; break;
+		case POSTL_STR:
+			val.strv=str_cstr(v.strv);
+			str_release(v.strv);
+			break;
+		case POSTL_BLOCK: val.blockv=v.blockv; break;
 	}
-	postl_stackval_t val=prog->stack->val;
-	stackitem_t *si=prog->stack;
-	prog->stack=si->next;
-	free(si);
-	prog->stacksz--;
 	return val;
 }
 
@@ -1319,154 +3189,496 @@ void postl_stackval_release(postl_stackval_t val){
 		free(val.strv);
 	} else if(val.type==POSTL_BLOCK){
 		if(!val.blockv)return;
-		token_t *tokens=val.blockv->tokens;
-		for(int i=0;i<val.blockv->len;i++){
-			free(tokens[i].str);
-		}
-		free(tokens);
+		code_release(val.blockv);
 	}
 }
 
-const char* postl_callfunction(postl_program_t *prog,const char *name){
-	static char errbuf[256]={'\0'};
-	DBGF("postl_callfunction(%p,%s)",prog,name);
-
-	int h=namehash(name);
+static const char* callfunction(postl_program_t *prog,int sym){
+	DBG(const char *name=symbol_name(&prog->syms,sym);)
 
 	// Check for a user-defined function
 	{
-		funcmap_llitem_t *lli=prog->fmap[h];
-		while(lli){
-			if(strcmp(lli->item.name,name)==0)break;
-			lli=lli->next;
-		}
+		funcmap_llitem_t *lli=funcmap_lookup(prog,sym);
 		if(lli!=NULL){
 			DBGF("Calling '%s' -> user-defined function...",name);
 			if(lli->item.cfunc){
 				DBGF("'%s' is a C function",name);
+				out_flush(&prog->out);
+				if(prog->running>0){
+					// The calling block was compiled without a scope if the function
+					// was registered after that; it may def, so give the block one now
+					frame_t *f=&prog->frames[prog->nframes-1];
+					if(!f->scoped&&f->code->block){
+						scope_enter(prog);
+						f->scoped=true;
+					}
+				}
+				prog->suspend=false;
 				lli->item.cfunc(prog);
+				if(prog->suspend)return suspended;
+			} else if(lli->item.isvar){
+				DBGF("'%s' is a variable",name);
+				stack_push(prog,value_copy(lli->item.val));
 			} else {
 				DBGF("'%s' is a token function",name);
-				if(lli->item.code.sz==0){
-					return "postl: [DBG] Empty token list in code_t";
+				if(!lli->item.code){
+					return "postl: [DBG] No code in function map item";
 				}
-				assert(!prog->buildblock);
-				DBGF("'%s' has %d tokens",name,lli->item.code.len);
-				const char *errstr=execute_block(prog,lli->item.code);
-				if(errstr){
-					if(prog->buildblock){
-						for(int i=0;i<prog->buildblock->len;i++){
-							free(prog->buildblock->tokens[i].str);
-						}
-						free(prog->buildblock->tokens);
-						free(prog->buildblock);
-					}
-					return errstr;
-				}
-				assert(!prog->buildblock);
+				DBGF("'%s' has %d instructions",name,lli->item.code->len);
+				// The function might be redefined while it runs
+				frame_push(prog,code_retain(lli->item.code),false);
 			}
 			return NULL;
 		}
 	}
 
-	/*// Check for a variable
-	{
-		var_llitem_t *lli=prog->vmap[h];
-		while(lli){
-			if(strcmp(lli->item.name,name)==0)break;
-			lli=lli->next;
+	// Check for a built-in function
+	if(sym<NUM_BUILTINS)return execute_builtin(prog,sym);
+
+	// Report error
+	snprintf(prog->errbuf,sizeof(prog->errbuf),"postl: function or variable '%s' not found",symbol_name(&prog->syms,sym));
+	return prog->errbuf;
+}
+
+const char* postl_callfunction(postl_program_t *prog,const char *name){
+	DBGF("postl_callfunction(%p,%s)",prog,name);
+	int sym=symbol_find(&prog->syms,name);
+	if(sym==-1){
+		snprintf(prog->errbuf,sizeof(prog->errbuf),"postl: function or variable '%s' not found",name);
+		return prog->errbuf;
+	}
+	int base=prog->nframes;
+	const char *errstr=callfunction(prog,sym);
+	if(errstr==suspended)errstr="postl: Only code run by postl_runcode_step can be suspended";
+	else if(!errstr)errstr=run_to_end(prog,base);
+	out_flush(&prog->out);
+	return errstr;
+}
+
+void postl_set_output(postl_program_t *prog,postl_output_func_t sink,void *ctx){
+	out_flush(&prog->out);
+	prog->out.sink=sink;
+	prog->out.ctx=ctx;
+}
+
+void postl_set_output_file(postl_program_t *prog,FILE *f){
+	postl_set_output(prog,sink_file,f);
+}
+
+void postl_set_output_fd(postl_program_t *prog,int fd){
+	postl_set_output(prog,sink_fd,(void*)(intptr_t)fd);
+}
+
+void postl_flush(postl_program_t *prog){
+	out_flush(&prog->out);
+}
+
+void postl_set_input(postl_program_t *prog,postl_input_func_t source,void *ctx){
+	prog->in.source=source;
+	prog->in.ctx=ctx;
+	prog->in.eof=false;
+}
+
+void postl_set_input_file(postl_program_t *prog,FILE *f){
+	postl_set_input(prog,source_file,f);
+}
+
+void postl_set_input_fd(postl_program_t *prog,int fd){
+	postl_set_input(prog,source_fd,(void*)(intptr_t)fd);
+}
+
+// Jobs are dealt out to the workers' queues in turn. A worker takes its jobs
+// from the front of its queue; one that has run out steals from the back of
+// another's, which is the job that would otherwise wait longest. Each worker
+// keeps one program, restored to the pool's snapshot after every job.
+struct postl_job_t{
+	char *source;
+	size_t sourcelen;
+	postl_stackval_t *vals; // the initial stack, and after the job the result
+	int nvals;
+	char *output;
+	size_t outlen,outcap;
+	char *errstr;
+	int refcount; // the submitter and the pool
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+typedef struct jobqueue_t{
+	pthread_mutex_t lock;
+	postl_job_t **jobs; // ring buffer
+	int head,len,cap;
+} jobqueue_t;
+
+typedef struct worker_t{
+	struct postl_pool_t *pool;
+	int id;
+	pthread_t thread;
+	jobqueue_t queue;
+	postl_program_t *prog;
+	postl_job_t *job; // the job running, which output goes to
+} worker_t;
+
+struct postl_pool_t{
+	worker_t *workers;
+	int nworkers;
+	postl_snapshot_t *snap;
+	unsigned next; // the worker to give the next job to
+	int queued; // jobs in all queues
+	bool stopping;
+	pthread_mutex_t lock; // idle workers sleep on wake under lock
+	pthread_cond_t wake;
+};
+
+static void jobqueue_push(jobqueue_t *q,postl_job_t *job){
+	pthread_mutex_lock(&q->lock);
+	if(q->len==q->cap){
+		int newcap=q->cap==0?16:2*q->cap;
+		postl_job_t **jobs=malloc(newcap,postl_job_t*);
+		if(!jobs)outofmem();
+		for(int i=0;i<q->len;i++)jobs[i]=q->jobs[(q->head+i)%q->cap];
+		free(q->jobs);
+		q->jobs=jobs;
+		q->head=0;
+		q->cap=newcap;
+	}
+	q->jobs[(q->head+q->len++)%q->cap]=job;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// takes from the front, or when stealing from the back; NULL if empty
+static postl_job_t* jobqueue_take(jobqueue_t *q,bool steal){
+	pthread_mutex_lock(&q->lock);
+	postl_job_t *job=NULL;
+	if(q->len>0){
+		if(steal)job=q->jobs[(q->head+q->len-1)%q->cap];
+		else {
+			job=q->jobs[q->head];
+			q->head=(q->head+1)%q->cap;
 		}
-		if(lli!=NULL){
+		q->len--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+static void job_release(postl_job_t *job){
+	if(__atomic_sub_fetch(&job->refcount,1,__ATOMIC_ACQ_REL)>0)return;
+	free(job->source);
+	for(int i=0;i<job->nvals;i++)postl_stackval_release(job->vals[i]);
+	free(job->vals);
+	free(job->output);
+	free(job->errstr);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	free(job);
+}
 
+static void sink_job(void *ctx,const char *data,int len){
+	postl_job_t *job=((worker_t*)ctx)->job;
+	if(job->outlen+len>job->outcap){
+		job->outcap=job->outcap==0?256:2*job->outcap;
+		if(job->outcap<job->outlen+len)job->outcap=job->outlen+len;
+		job->output=realloc(job->output,job->outcap,char);
+		if(!job->output)outofmem();
+	}
+	memcpy(job->output+job->outlen,data,len);
+	job->outlen+=len;
+}
+
+static int source_empty(void *ctx,char *buf,int size){
+	(void)ctx; (void)buf; (void)size;
+	return 0;
+}
+
+static void job_run(worker_t *w,postl_job_t *job){
+	postl_program_t *prog=w->prog;
+	w->job=job;
+	postl_stack_pushes(prog,job->nvals,job->vals);
+	for(int i=0;i<job->nvals;i++)postl_stackval_release(job->vals[i]);
+	free(job->vals);
+	job->vals=NULL;
+	job->nvals=0;
+
+	const char *errstr=postl_runcode_n(prog,job->source,job->sourcelen);
+	free(job->source);
+	job->source=NULL;
+	if(!errstr){
+		// Blocks refer to code that isn't safe to share between threads
+		int n=postl_stack_size(prog);
+		postl_stackval_t *vals=malloc(n>0?n:1,postl_stackval_t);
+		if(!vals)outofmem();
+		for(int i=n-1;i>=0;i--){
+			vals[i]=postl_stack_pop(prog);
+			if(vals[i].type==POSTL_BLOCK)errstr="postl: A job can't leave a block on the stack";
+		}
+		if(errstr){
+			for(int i=0;i<n;i++)postl_stackval_release(vals[i]);
+			free(vals);
+		} else {
+			job->vals=vals;
+			job->nvals=n;
 		}
-	}*/
+	}
+	if(errstr)job->errstr=memdup(errstr,strlen(errstr)+1);
+	postl_restore(prog,w->pool->snap);
+	w->job=NULL;
+
+	pthread_mutex_lock(&job->lock);
+	__atomic_store_n(&job->done,true,__ATOMIC_RELEASE);
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	job_release(job);
+}
 
-	// Check for a built-in function
-	bool found=false;
-	const char *err=execute_builtin(prog,name,&found);
-	if(found)return err;
+static void* worker_main(void *arg){
+	worker_t *w=(worker_t*)arg;
+	postl_pool_t *pool=w->pool;
+	while(true){
+		postl_job_t *job=jobqueue_take(&w->queue,false);
+		for(int i=1;!job&&i<pool->nworkers;i++){
+			job=jobqueue_take(&pool->workers[(w->id+i)%pool->nworkers].queue,true);
+		}
+		if(job){
+			__atomic_sub_fetch(&pool->queued,1,__ATOMIC_SEQ_CST);
+			job_run(w,job);
+			continue;
+		}
+		// A job submitted after queued is read here still wakes this worker,
+		// since the submitter signals under the lock
+		pthread_mutex_lock(&pool->lock);
+		while(__atomic_load_n(&pool->queued,__ATOMIC_SEQ_CST)==0&&!pool->stopping){
+			pthread_cond_wait(&pool->wake,&pool->lock);
+		}
+		bool stop=pool->stopping&&__atomic_load_n(&pool->queued,__ATOMIC_SEQ_CST)==0;
+		pthread_mutex_unlock(&pool->lock);
+		if(stop)return NULL;
+	}
+}
 
-	// Report error
-	snprintf(errbuf,256,"postl: function or variable '%s' not found",name);
-	return errbuf;
+postl_pool_t* postl_pool_make(int nworkers,const postl_snapshot_t *snap){
+	DBGF("postl_pool_make(%d,%p)",nworkers,snap);
+	if(nworkers<1)nworkers=1;
+	postl_pool_t *pool=malloc(1,postl_pool_t);
+	if(!pool)outofmem();
+	// The pool's own snapshot, so that the caller's can be destroyed
+	postl_program_t *base=snap?postl_snapshot_makeprogram(snap):postl_makeprogram();
+	pool->snap=postl_snapshot(base);
+	postl_destroy(base);
+	pool->nworkers=nworkers;
+	pool->next=0;
+	pool->queued=0;
+	pool->stopping=false;
+	pthread_mutex_init(&pool->lock,NULL);
+	pthread_cond_init(&pool->wake,NULL);
+	pool->workers=malloc(nworkers,worker_t);
+	if(!pool->workers)outofmem();
+	for(int i=0;i<nworkers;i++){
+		worker_t *w=&pool->workers[i];
+		w->pool=pool;
+		w->id=i;
+		pthread_mutex_init(&w->queue.lock,NULL);
+		w->queue.jobs=NULL;
+		w->queue.head=w->queue.len=w->queue.cap=0;
+		w->prog=postl_snapshot_makeprogram(pool->snap);
+		postl_set_output(w->prog,sink_job,w);
+		postl_set_input(w->prog,source_empty,NULL);
+		w->job=NULL;
+	}
+	for(int i=0;i<nworkers;i++){
+		if(pthread_create(&pool->workers[i].thread,NULL,worker_main,&pool->workers[i])!=0){
+			fprintf(stderr,"postl: Cannot create worker thread\n");
+			exit(1);
+		}
+	}
+	return pool;
+}
+
+postl_job_t* postl_pool_submit(postl_pool_t *pool,const char *source,size_t len,int nvals,const postl_stackval_t *vals){
+	DBGF("postl_pool_submit(%p,<<<\"%.*s\">>>,%d)",pool,(int)len,source,nvals);
+	postl_job_t *job=malloc(1,postl_job_t);
+	if(!job)outofmem();
+	job->source=memdup(source,len);
+	job->sourcelen=len;
+	job->vals=malloc(nvals>0?nvals:1,postl_stackval_t);
+	if(!job->vals)outofmem();
+	for(int i=0;i<nvals;i++){
+		if(vals[i].type==POSTL_STR&&vals[i].strv)job->vals[i]=postl_stackval_makestr(vals[i].strv);
+		else if(vals[i].type==POSTL_NUM)job->vals[i]=postl_stackval_makenum(vals[i].numv);
+		else {
+			fprintf(stderr,"postl: Stack values for a job must be numbers or non-NULL strings\n");
+			exit(1);
+		}
+	}
+	job->nvals=nvals;
+	job->output=NULL;
+	job->outlen=job->outcap=0;
+	job->errstr=NULL;
+	job->refcount=2;
+	job->done=false;
+	pthread_mutex_init(&job->lock,NULL);
+	pthread_cond_init(&job->cond,NULL);
+
+	unsigned w=__atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED)%pool->nworkers;
+	jobqueue_push(&pool->workers[w].queue,job);
+	__atomic_add_fetch(&pool->queued,1,__ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+void postl_pool_destroy(postl_pool_t *pool){
+	DBGF("postl_pool_destroy(%p)",pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping=true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i=0;i<pool->nworkers;i++)pthread_join(pool->workers[i].thread,NULL);
+	for(int i=0;i<pool->nworkers;i++){
+		worker_t *w=&pool->workers[i];
+		postl_destroy(w->prog);
+		free(w->queue.jobs);
+		pthread_mutex_destroy(&w->queue.lock);
+	}
+	free(pool->workers);
+	postl_snapshot_destroy(pool->snap);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool);
+}
+
+bool postl_job_done(postl_job_t *job){
+	return __atomic_load_n(&job->done,__ATOMIC_ACQUIRE);
+}
+
+const char* postl_job_wait(postl_job_t *job){
+	DBGF("postl_job_wait(%p)",job);
+	if(!postl_job_done(job)){
+		pthread_mutex_lock(&job->lock);
+		while(!job->done)pthread_cond_wait(&job->cond,&job->lock);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return job->errstr;
+}
+
+const postl_stackval_t* postl_job_stack(postl_job_t *job,int *nvalsp){
+	if(postl_job_wait(job)){
+		*nvalsp=0;
+		return NULL;
+	}
+	*nvalsp=job->nvals;
+	return job->vals;
+}
+
+const char* postl_job_output(postl_job_t *job,size_t *lenp){
+	postl_job_wait(job);
+	*lenp=job->outlen;
+	return job->outlen>0?job->output:"";
+}
+
+void postl_job_release(postl_job_t *job){
+	DBGF("postl_job_release(%p)",job);
+	job_release(job);
+}
+
+void postl_profile_report(postl_program_t *prog,int top){
+#ifndef POSTL_PROFILE
+	(void)prog; (void)top;
+	fprintf(stderr,"postl: No profile; build postl with -DPOSTL_PROFILE\n");
+#else
+	const profile_t *pr=&prog->profile;
+	profile_ngram_t *ngrams=malloc(pr->used>0?pr->used:1,profile_ngram_t);
+	if(!ngrams)outofmem();
+	int nngrams=0;
+	for(int i=0;i<pr->sz;i++){
+		const profile_entry_t *e=&pr->entries[i];
+		if(!e->code)continue;
+		ngrams[nngrams].text=profile_ngram_text(&prog->syms,e);
+		ngrams[nngrams].n=e->n;
+		ngrams[nngrams].count=e->count;
+		nngrams++;
+	}
+
+	// Merge the n-grams that occur in several places
+	qsort(ngrams,nngrams,sizeof(profile_ngram_t),profile_ngram_cmp_text);
+	int nmerged=0;
+	for(int i=0;i<nngrams;i++){
+		if(nmerged>0&&profile_ngram_cmp_text(&ngrams[nmerged-1],&ngrams[i])==0){
+			ngrams[nmerged-1].count+=ngrams[i].count;
+			free(ngrams[i].text);
+		} else ngrams[nmerged++]=ngrams[i];
+	}
+	qsort(ngrams,nmerged,sizeof(profile_ngram_t),profile_ngram_cmp_count);
+
+	fprintf(stderr,"postl profile: %ld instructions executed\n",pr->ninstrs);
+	for(int i=0,shown=0;i<nmerged;i++){
+		if(i==0||ngrams[i].n!=ngrams[i-1].n){
+			fprintf(stderr,"Hottest %d-grams:\n",ngrams[i].n);
+			shown=0;
+		}
+		if(shown++<top){
+			fprintf(stderr,"  %12ld  %5.1f%%  %s\n",ngrams[i].count,
+				100.0*ngrams[i].count/pr->ninstrs,ngrams[i].text);
+		}
+		free(ngrams[i].text);
+	}
+	free(ngrams);
+#endif
 }
 
 void postl_destroy(postl_program_t *prog){
 	DBGF("postl_destroy(%p)",prog);
+	frames_unwind(prog,0);
+	free(prog->frames);
+	out_flush(&prog->out);
+	free(prog->out.buf);
+	free(prog->in.buf);
+	for(int i=0;i<256;i++)if(prog->chars[i])str_release(prog->chars[i]);
 
 	DBGF("Stack:");
-	while(prog->stack){
-		stackitem_t *si=prog->stack;
+	for(int i=prog->stacksz-1;i>=0;i--){
+		value_t *si=prog->stack+i;
 		DBG(
-			printf("- type=%s ",valtype_string(si->val.type));
-			switch(si->val.type){
-				case POSTL_NUM: printf("numv=%g\n",si->val.numv); break;
-				case POSTL_STR: printf("strv=%s\n",si->val.strv); break;
+			printf("- type=%s ",valtype_string(si->type));
+			switch(si->type){
+				case POSTL_NUM: printf("numv=%g\n",si->numv); break;
+				case POSTL_STR: printf("strv=%.*s\n",si->strv->len,si->strv->data); break;
 				case POSTL_BLOCK: printf("blockv=...\n"); break;
 				default: assert(false);
 			}
 		)
-		postl_stackval_release(si->val);
-		prog->stack=si->next;
-		free(si);
+		value_release(*si);
 	}
+	free(prog->stack);
 
 	DBGF("Function map:");
-	for(int h=0;h<HASHMAP_SIZE;h++){
-		DBG(if(prog->fmap[h])DBGF("- h=%d:",h);)
-		while(prog->fmap[h]){
-			funcmap_llitem_t *lli=prog->fmap[h];
-			DBGF("  - name=%s",lli->item.name);
+	for(int i=0;i<prog->fmapsz;i++){
+		if(prog->fmap[i].sym==-1)continue;
+		DBGF("- name=%s",symbol_name(&prog->syms,prog->fmap[i].sym));
+		while(prog->fmap[i].bindings){
+			funcmap_llitem_t *lli=prog->fmap[i].bindings;
 			funcmap_item_release(lli->item);
-			prog->fmap[h]=lli->next;
-			free(lli);
+			prog->fmap[i].bindings=lli->next;
 		}
 	}
-
-	/*for(int h=0;h<HASHMAP_SIZE;h++){
-		while(prog->vmap[h]){
-			var_llitem_t *lli=prog->vmap[h];
-			free(lli->item.name);
-			postl_stackval_release(lli->item.val);
-			lli=lli->next;
-		}
-	}*/
-
-	DBGF("buildblock=%p",prog->buildblock);
-	if(prog->buildblock){
-		token_t *tokens=prog->buildblock->tokens;
-		for(int i=0;i<prog->buildblock->len;i++){
-			free(tokens[i].str);
-		}
-		free(tokens);
-		free(prog->buildblock);
+	free(prog->fmap);
+	pool_destroy(&prog->fmappool);
+	arena_destroy(&prog->scratch);
+	symtab_destroy(&prog->syms);
+
+#ifdef POSTL_PROFILE
+	for(int i=0;i<prog->profile.sz;i++){
+		if(prog->profile.entries[i].code)code_release(prog->profile.entries[i].code);
 	}
+	free(prog->profile.entries);
+#endif
 
-	while(prog->scopestack){
-		for(int h=0;h<HASHMAP_SIZE;h++){
-			while(prog->scopestack->vars[h]){
-				name_llitem_t *lli=prog->scopestack->vars[h];
-				free(lli->name);
-				prog->scopestack->vars[h]=lli->next;
-				free(lli);
-			}
-		}
-		scope_frame_t *frame=prog->scopestack;
-		prog->scopestack=frame->next;
-		free(frame);
-	}
+	free(prog->scopelog);
+	free(prog->scopestack);
 
+	// Last, since everything above may look at frozen objects
+	frozen_release(prog->frozen);
 	free(prog);
-
-	/*DBG(
-		DBGF("builtins_hmap:");
-		for(int h=0;h<HASHMAP_SIZE;h++){
-			if(builtins_hmap[h])DBGF("- h=%d:",h);
-			builtin_llitem_t *lli=builtins_hmap[h];
-			while(lli){
-				DBGF("  - name=%s",lli->name);
-				lli=lli->next;
-			}
-		}
-	)*/
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdbool.h>
+
 typedef enum postl_valtype_t{
 	POSTL_NUM,
 	POSTL_STR,
@@ -18,13 +21,45 @@ typedef struct postl_stackval_t{
 	code_t *blockv;
 } postl_stackval_t;
 
+// Programs share no state with each other, so different programs can be used
+// from different threads at the same time. A single program is not thread-safe.
 struct postl_program_t;
 typedef struct postl_program_t postl_program_t;
 
 
 postl_program_t* postl_makeprogram(void);
 void postl_register(postl_program_t *prog,const char *name,void (*func)(postl_program_t*));
-const char* postl_runcode(postl_program_t *prog,const char *source); //maybe returns error string (at least valid till next call to this function)
+const char* postl_runcode(postl_program_t *prog,const char *source); //maybe returns error string (at least valid till next call into this program)
+const char* postl_runcode_n(postl_program_t *prog,const char *source,size_t len); //source needn't be NUL-terminated, and may contain NULs in strings; nothing refers to it after this returns
+
+// Compiled code can be saved, and run later (in any program) without tokenising and compiling it again. The format is
+// versioned and checksummed, but specific to the machine's byte order.
+const char* postl_compilecode(postl_program_t *prog,const char *source,size_t len,void **imagep,size_t *sizep); //doesn't run the code; on success *imagep is malloc'ed. maybe returns error string
+const char* postl_runcompiled(postl_program_t *prog,const void *image,size_t size); //nothing refers to image after this returns. maybe returns error string
+
+// Running code can be limited, so that a script that never stops can't hold on to its thread. The limits are checked
+// when a block starts, when a loop goes round and between stretches of long code, so at least every 16384 instructions. postl_runcode and the other
+// calls fail when a limit is reached; postl_runcode_step instead leaves the code to be resumed later.
+typedef enum postl_status_t{
+	POSTL_DONE,
+	POSTL_ERROR,
+	POSTL_PREEMPTED,
+	POSTL_PENDING,
+} postl_status_t;
+void postl_set_budget(postl_program_t *prog,long maxinstrs,double maxseconds); //for each call that runs code; 0 means no limit
+void postl_interrupt(postl_program_t *prog); //may be called from any thread; preempts the code running, or else the next code run
+postl_status_t postl_runcode_step(postl_program_t *prog,const char *source,size_t len); //like postl_runcode_n, but may be preempted
+postl_status_t postl_resume(postl_program_t *prog); //goes on with preempted code, with a new budget
+void postl_abandon(postl_program_t *prog); //drops preempted code, as if it had failed
+const char* postl_error(postl_program_t *prog); //after POSTL_ERROR the error, after POSTL_PREEMPTED the limit reached (valid till next call into this program)
+
+// A registered C function can suspend the code that called it, to wait for something without holding up the thread:
+// once the function returns, postl_runcode_step or postl_resume returns POSTL_PENDING. When the function's results are
+// ready, push them with postl_stack_push and call postl_resume. Only code run by postl_runcode_step can be suspended;
+// in code run by postl_runcode and the other calls, suspending is an error.
+void postl_suspend(postl_program_t *prog); //only from a registered C function
+void postl_set_userdata(postl_program_t *prog,void *data);
+void* postl_userdata(postl_program_t *prog);
 
 postl_stackval_t postl_stackval_makenum(double num);
 postl_stackval_t postl_stackval_makestr(const char *str);
@@ -36,5 +71,54 @@ postl_stackval_t postl_stack_pop(postl_program_t *prog); //returned stackval mus
 
 void postl_stackval_release(postl_stackval_t val);
 
-const char* postl_callfunction(postl_program_t *prog,const char *name); //maybe returns error string (at least valid till next call to this function)
+const char* postl_callfunction(postl_program_t *prog,const char *name); //maybe returns error string (at least valid till next call into this program)
+
+// Printed output is buffered and passed to the sink when the buffer is full, when the script calls 'flush', before
+// reading input or calling a registered C function, and before postl_runcode and postl_callfunction return.
+// The default sink is stdout.
+typedef void (*postl_output_func_t)(void *ctx,const char *data,int len);
+void postl_set_output(postl_program_t *prog,postl_output_func_t sink,void *ctx); //NULL sink means stdout
+void postl_set_output_file(postl_program_t *prog,FILE *f); //flushes f after every batch
+void postl_set_output_fd(postl_program_t *prog,int fd);
+void postl_flush(postl_program_t *prog);
+
+// Input for getc, readline, read, readall and readnum is buffered; the source is asked for more only when the
+// buffer runs out. The default source is stdin. Input already buffered is still read after changing the source.
+typedef int (*postl_input_func_t)(void *ctx,char *buf,int size); //returns the number of bytes read (at most size); 0 at end of input
+void postl_set_input(postl_program_t *prog,postl_input_func_t source,void *ctx); //NULL source means stdin
+void postl_set_input_file(postl_program_t *prog,FILE *f);
+void postl_set_input_fd(postl_program_t *prog,int fd);
+
+// A snapshot holds a program's state: its stack, definitions and scopes. Programs made from it, or restored to it,
+// share the snapshot's strings and code instead of copying them, so this is cheap even after a large library has been
+// defined. Strings and code that exist when a snapshot is taken become read-only and are shared between all these
+// programs, which may run on different threads. A snapshot may be used from several threads at once, and destroyed
+// while programs made from it still exist.
+struct postl_snapshot_t;
+typedef struct postl_snapshot_t postl_snapshot_t;
+postl_snapshot_t* postl_snapshot(postl_program_t *prog);
+postl_program_t* postl_snapshot_makeprogram(const postl_snapshot_t *snap); //takes the input and output settings of the program the snapshot was taken of
+void postl_restore(postl_program_t *prog,const postl_snapshot_t *snap); //keeps prog's input and output settings and its unread input
+void postl_snapshot_destroy(postl_snapshot_t *snap);
+postl_program_t* postl_program_clone(postl_program_t *prog); //a new program with the same state; takes a snapshot of prog
+
+// A pool runs jobs on worker threads. Each worker keeps a program made from the pool's snapshot ready, and restores it
+// to the snapshot after every job, so a job sees only the snapshot's definitions and none of other jobs' changes.
+// Registered C functions in the snapshot may be called from several workers at once. Jobs read from an empty input,
+// and their output is collected with the job. Jobs may be submitted from any thread.
+struct postl_pool_t;
+typedef struct postl_pool_t postl_pool_t;
+struct postl_job_t;
+typedef struct postl_job_t postl_job_t;
+postl_pool_t* postl_pool_make(int nworkers,const postl_snapshot_t *snap); //snap may be NULL; the pool doesn't refer to snap after this returns
+postl_job_t* postl_pool_submit(postl_pool_t *pool,const char *source,size_t len,int nvals,const postl_stackval_t *vals); //the job starts with vals (numbers and strings only) on the stack; source and vals are copied
+void postl_pool_destroy(postl_pool_t *pool); //runs all submitted jobs first; their results stay valid
+bool postl_job_done(postl_job_t *job);
+const char* postl_job_wait(postl_job_t *job); //waits until the job is done; maybe returns error string (valid till the job is released)
+const postl_stackval_t* postl_job_stack(postl_job_t *job,int *nvalsp); //waits; the stack the job left, bottom first; NULL after an error, or if a block was left on it. The job owns the values
+const char* postl_job_output(postl_job_t *job,size_t *lenp); //waits; everything the job printed
+void postl_job_release(postl_job_t *job); //may be called before the job is done
+
+
+void postl_profile_report(postl_program_t *prog,int top); //prints the top most executed instruction n-grams to stderr; needs postl built with -DPOSTL_PROFILE
 void postl_destroy(postl_program_t *prog);
@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// Runs many scripts on one thread that each make several slow requests
+// through a registered C function, which suspends the script until the reply
+// comes in instead of waiting for it, and compares with waiting for each reply
+// in turn. Also checks that suspending is refused where it can't be resumed.
+
+#define NTASKS 2000
+#define NBLOCKING 20 // scripts run with waiting replies, as that's slow
+#define DELAY 0.002 // seconds until a request is answered
+
+static const char *library=
+	"{ \"k\" def k fetch 1 + } \"get\" def\n";
+
+typedef struct task_t{
+	char source[160];
+	postl_program_t *prog;
+	double arg,due; // the request in flight
+	double expect;
+} task_t;
+
+static task_t tasks[NTASKS];
+static bool blocking;
+
+// Requests in flight, in the order they're answered
+static task_t *inflight[NTASKS];
+static int qhead,qlen;
+
+static void sleep_until(double t){
+	double d=t-now();
+	if(d<=0)return;
+	struct timespec ts={(time_t)d,(long)((d-(time_t)d)*1e9)};
+	nanosleep(&ts,NULL);
+}
+
+static double answer(double arg){
+	return arg*2;
+}
+
+// 'n fetch' gives 2n, after DELAY
+static void fetch(postl_program_t *prog){
+	postl_stackval_t val=postl_stack_pop(prog);
+	double arg=val.type==POSTL_NUM?val.numv:0;
+	postl_stackval_release(val);
+	if(blocking){
+		sleep_until(now()+DELAY);
+		postl_stack_push(prog,postl_stackval_makenum(answer(arg)));
+		return;
+	}
+	task_t *t=(task_t*)postl_userdata(prog);
+	t->arg=arg;
+	t->due=now()+DELAY;
+	inflight[(qhead+qlen++)%NTASKS]=t;
+	postl_suspend(prog);
+}
+
+static postl_program_t* makeprogram(task_t *t){
+	postl_program_t *prog=postl_makeprogram();
+	postl_register(prog,"fetch",fetch);
+	postl_set_userdata(prog,t);
+	const char *errstr=postl_runcode(prog,library);
+	if(errstr){
+		fprintf(stderr,"library: %s\n",errstr);
+		exit(1);
+	}
+	return prog;
+}
+
+static void make_tasks(int ntasks){
+	for(int i=0;i<ntasks;i++){
+		task_t *t=&tasks[i];
+		int b=i*10;
+		// calls from a function, an eval, a loop and the script itself
+		snprintf(t->source,sizeof(t->source),
+			"0 %d get + %d get + { %d get + } eval 1 { %d get + 0 } while %d fetch +",
+			b+1,b+2,b+3,b+4,b+5);
+		t->expect=2*(4*b+1+2+3+4)+4+answer(b+5);
+		t->prog=makeprogram(t);
+	}
+	qhead=qlen=0;
+}
+
+// returns false on failure
+static bool finish(task_t *t,postl_status_t status){
+	bool ok=true;
+	if(status==POSTL_PENDING)return true;
+	if(status!=POSTL_DONE){
+		fprintf(stderr,"%s: %s\n",t->source,postl_error(t->prog));
+		ok=false;
+	} else {
+		postl_stackval_t val=postl_stack_pop(t->prog);
+		if(postl_stack_size(t->prog)!=0||val.type!=POSTL_NUM||val.numv!=t->expect){
+			fprintf(stderr,"wrong result: %s\n",t->source);
+			ok=false;
+		}
+		postl_stackval_release(val);
+	}
+	postl_destroy(t->prog);
+	t->prog=NULL;
+	return ok;
+}
+
+static bool run_multiplexed(int ntasks){
+	blocking=false;
+	make_tasks(ntasks);
+	bool ok=true;
+	for(int i=0;i<ntasks;i++){
+		task_t *t=&tasks[i];
+		ok=finish(t,postl_runcode_step(t->prog,t->source,strlen(t->source)))&&ok;
+	}
+	while(qlen>0){
+		task_t *t=inflight[qhead];
+		qhead=(qhead+1)%NTASKS;
+		qlen--;
+		sleep_until(t->due);
+		postl_stack_push(t->prog,postl_stackval_makenum(answer(t->arg)));
+		ok=finish(t,postl_resume(t->prog))&&ok;
+	}
+	return ok;
+}
+
+static bool run_blocking(int ntasks){
+	blocking=true;
+	make_tasks(ntasks);
+	bool ok=true;
+	for(int i=0;i<ntasks;i++){
+		task_t *t=&tasks[i];
+		ok=finish(t,postl_runcode_step(t->prog,t->source,strlen(t->source)))&&ok;
+	}
+	return ok;
+}
+
+static void clear_stack(postl_program_t *prog){
+	while(postl_stack_size(prog)>0)postl_stackval_release(postl_stack_pop(prog));
+}
+
+static bool expect_error(const char *what,const char *errstr){
+	if(errstr&&strcmp(errstr,"postl: Only code run by postl_runcode_step can be suspended")==0)return true;
+	fprintf(stderr,"%s: %s\n",what,errstr?errstr:"(no error)");
+	return false;
+}
+
+// Suspending where the caller can't be resumed is an error, after which the
+// program can still be used; and suspended code can be abandoned
+static bool check_refused(void){
+	blocking=false;
+	qhead=qlen=0;
+	task_t *t=&tasks[0];
+	t->prog=makeprogram(t);
+	bool ok=expect_error("postl_runcode",postl_runcode(t->prog,"1 2 get"));
+	postl_stack_push(t->prog,postl_stackval_makenum(3));
+	ok=expect_error("postl_callfunction",postl_callfunction(t->prog,"fetch"))&&ok;
+	clear_stack(t->prog);
+
+	const char *source="{ 5 get } eval 1 +";
+	ok=postl_runcode_step(t->prog,source,strlen(source))==POSTL_PENDING&&ok;
+	postl_abandon(t->prog);
+	clear_stack(t->prog);
+	const char *errstr=postl_runcode(t->prog,"6 7 *");
+	postl_stackval_t val=postl_stack_pop(t->prog);
+	ok=!errstr&&val.type==POSTL_NUM&&val.numv==42&&ok;
+	postl_stackval_release(val);
+	if(!ok)fprintf(stderr,"abandoning suspended code failed\n");
+	postl_destroy(t->prog);
+	return ok;
+}
+
+int main(void){
+	if(!check_refused())return 1;
+
+	double start=now();
+	if(!run_blocking(NBLOCKING))return 1;
+	double blocked=now()-start;
+	start=now();
+	if(!run_multiplexed(NTASKS))return 1;
+	double multiplexed=now()-start;
+
+	printf("%d scripts making 5 requests of %.0f ms each, on one thread:\n",NTASKS,DELAY*1e3);
+	printf("waiting for each reply:    %.0f ms for %d scripts, so about %.0f ms for all\n",
+		blocked*1e3,NBLOCKING,blocked*1e3*NTASKS/NBLOCKING);
+	printf("suspending until replies:  %.0f ms for all\n",multiplexed*1e3);
+}
@@ -0,0 +1,173 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// Runs many small jobs, some of them much longer than the rest, through a
+// pool, and compares throughput with making, running and destroying a program
+// per job on the same number of threads, with the jobs split evenly between
+// them beforehand. Then measures the latency of single jobs through the pool.
+
+#define NJOBS 20000
+#define NFUNCS 200
+#define LONGEVERY 50 // every so many jobs is LONGFACTOR times longer
+#define LONGFACTOR 100
+#define WINDOW 64 // jobs in flight in the latency test
+
+static char *library;
+static const char *job=
+	"\"n\" def 0 \"i\" def 0 i n < { i f7 + i 1 + \"i\" gdef i n < } while\n";
+
+static void build_library(void){
+	size_t cap=64*NFUNCS,len=0;
+	library=xmalloc(cap);
+	for(int i=0;i<NFUNCS;i++){
+		len+=snprintf(library+len,cap-len,"{ %d + } \"f%d\" def\n",i,i);
+	}
+}
+
+static int jobsize(int i){
+	return i%LONGEVERY==0?20*LONGFACTOR:20;
+}
+
+static double expected(int i){
+	double n=jobsize(i);
+	return n*(n-1)/2+7*n;
+}
+
+typedef struct thread_t{
+	int id,nthreads;
+	bool ok;
+} thread_t;
+
+static bool check(int i,int nvals,const postl_stackval_t *vals){
+	if(nvals!=1||vals[0].type!=POSTL_NUM||vals[0].numv!=expected(i)){
+		fprintf(stderr,"job %d: wrong result\n",i);
+		return false;
+	}
+	return true;
+}
+
+static void* naive_main(void *arg){
+	thread_t *t=(thread_t*)arg;
+	t->ok=true;
+	for(int i=t->id;i<NJOBS&&t->ok;i+=t->nthreads){
+		postl_program_t *prog=postl_makeprogram();
+		const char *errstr=postl_runcode(prog,library);
+		postl_stackval_t n=postl_stackval_makenum(jobsize(i));
+		postl_stack_push(prog,n);
+		if(!errstr)errstr=postl_runcode(prog,job);
+		if(errstr){
+			fprintf(stderr,"job %d: %s\n",i,errstr);
+			t->ok=false;
+		} else {
+			postl_stackval_t val=postl_stack_pop(prog);
+			t->ok=check(i,postl_stack_size(prog)+1,&val);
+			postl_stackval_release(val);
+		}
+		postl_destroy(prog);
+	}
+	return NULL;
+}
+
+// returns the wall time taken, or -1 on failure
+static double run_naive(int nthreads){
+	pthread_t threads[nthreads];
+	thread_t ts[nthreads];
+	double start=now();
+	for(int i=0;i<nthreads;i++){
+		ts[i].id=i;
+		ts[i].nthreads=nthreads;
+		start_thread(&threads[i],naive_main,&ts[i]);
+	}
+	bool ok=true;
+	for(int i=0;i<nthreads;i++){
+		pthread_join(threads[i],NULL);
+		ok=ok&&ts[i].ok;
+	}
+	return ok?now()-start:-1;
+}
+
+static postl_job_t* submit(postl_pool_t *pool,int i){
+	postl_stackval_t n=postl_stackval_makenum(jobsize(i));
+	return postl_pool_submit(pool,job,strlen(job),1,&n);
+}
+
+static bool finish(postl_job_t *j,int i){
+	const char *errstr=postl_job_wait(j);
+	bool ok;
+	if(errstr){
+		fprintf(stderr,"job %d: %s\n",i,errstr);
+		ok=false;
+	} else {
+		int nvals;
+		const postl_stackval_t *vals=postl_job_stack(j,&nvals);
+		ok=check(i,nvals,vals);
+	}
+	postl_job_release(j);
+	return ok;
+}
+
+static double run_pool(postl_pool_t *pool){
+	static postl_job_t *jobs[NJOBS];
+	double start=now();
+	for(int i=0;i<NJOBS;i++)jobs[i]=submit(pool,i);
+	bool ok=true;
+	for(int i=0;i<NJOBS;i++)ok=finish(jobs[i],i)&&ok;
+	return ok?now()-start:-1;
+}
+
+static int cmpdouble(const void *a,const void *b){
+	double x=*(const double*)a,y=*(const double*)b;
+	return x<y?-1:x>y;
+}
+
+// Keeps WINDOW jobs in flight, and measures each from submission until it's
+// waited for; returns false on failure
+static bool run_latency(postl_pool_t *pool,double *lat){
+	postl_job_t *jobs[WINDOW];
+	double started[WINDOW];
+	bool ok=true;
+	for(int i=0;i<NJOBS+WINDOW;i++){
+		int slot=i%WINDOW;
+		if(i>=WINDOW){
+			ok=finish(jobs[slot],i-WINDOW)&&ok;
+			lat[i-WINDOW]=now()-started[slot];
+		}
+		if(i<NJOBS){
+			started[slot]=now();
+			jobs[slot]=submit(pool,i);
+		}
+	}
+	return ok;
+}
+
+int main(int argc,char **argv){
+	int nthreads=nthreads_arg(argc,argv,4);
+	build_library();
+	postl_program_t *base=postl_makeprogram();
+	const char *errstr=postl_runcode(base,library);
+	if(errstr){
+		fprintf(stderr,"%s\n",errstr);
+		return 1;
+	}
+	postl_snapshot_t *snap=postl_snapshot(base);
+	postl_destroy(base);
+
+	double naive=run_naive(nthreads);
+	if(naive<0)return 1;
+	postl_pool_t *pool=postl_pool_make(nthreads,snap);
+	postl_snapshot_destroy(snap);
+	double pooled=run_pool(pool);
+	if(pooled<0)return 1;
+	printf("%d jobs on %d threads: program per job %.0f jobs/s; pool %.0f jobs/s\n",
+		NJOBS,nthreads,NJOBS/naive,NJOBS/pooled);
+
+	static double lat[NJOBS];
+	bool ok=run_latency(pool,lat);
+	postl_pool_destroy(pool);
+	free(library);
+	if(!ok)return 1;
+	qsort(lat,NJOBS,sizeof(double),cmpdouble);
+	printf("latency with %d jobs in flight: p50 %.1f us; p99 %.1f us; max %.1f us\n",
+		WINDOW,lat[NJOBS/2]*1e6,lat[NJOBS*99/100]*1e6,lat[NJOBS-1]*1e6);
+}
@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// A C function that defs a variable defs it in the scope of the block that
+// called it, also when the function was registered after the block was
+// compiled; the def mustn't leak out of the block.
+
+static capture_t out;
+
+// 'setx' defs x to 5
+static void setx(postl_program_t *prog){
+	const char *errstr=postl_runcode(prog,"5 \"x\" def");
+	if(errstr)fprintf(stderr,"setx: %s\n",errstr);
+}
+
+static bool check(bool early){
+	capture_clear(&out);
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_output(prog,capture_sink,&out);
+	if(early)postl_register(prog,"setx",setx);
+	const char *errstr=postl_runcode(prog,
+		"{ setx x print \" \" print } \"f\" def\n"
+		"{ 1 { setx } if x } \"g\" def\n"); // x is def'd in the if's block
+	if(!early)postl_register(prog,"setx",setx);
+	if(!errstr)errstr=postl_runcode(prog,
+		"1 \"x\" def f x print \" \" print\n"
+		"0 dup 2 < { setx x print \" \" print 1 + dup 2 < } while pop x print \" \" print\n"
+		"g print \" \" print x print");
+	postl_destroy(prog);
+	const char *expect="5 1 5 5 1 1 1";
+	if(errstr||strcmp(capture_str(&out),expect)!=0){
+		fprintf(stderr,"registered %s: expected '%s', got '%s'\n",early?"before":"after",expect,errstr?errstr:capture_str(&out));
+		return false;
+	}
+	return true;
+}
+
+int main(void){
+	bool ok=check(true);
+	ok=check(false)&&ok;
+	capture_free(&out);
+	return ok?0:1;
+}
@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include "testutil.h"
+
+// Compiles a script, runs the saved image in another program and checks that
+// it does the same as running the source; then checks that damaged images are
+// rejected with the right error, and that images damaged behind the
+// checksum's back are rejected or run without crashing (best under ASan).
+
+static const char *source=
+	"{ \"n\" def n 2 < { n } { n 1 - fib n 2 - fib + } ifelse } \"fib\" def\n"
+	"\"hello\" \", world\" + dup print lf strlen\n"
+	"0 5 dup 0 > { swap 1 + swap 1 - dup 0 > } while pop\n"
+	"15 fib 0.1 1e3 * -2.5 { 1 } eval + \"x\" gdef x\n";
+
+// Offsets of fields in the image header
+#define OFF_VERSION 4
+#define OFF_CHECKSUM 12
+#define OFF_NSYMS 16
+#define HEADERSIZE 32
+
+#define NMUTATIONS 20000
+
+typedef struct result_t{
+	capture_t out;
+	int nvals;
+	double vals[16];
+} result_t;
+
+static postl_program_t* makeprogram(result_t *r){
+	memset(r,0,sizeof(*r));
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_output(prog,capture_sink,&r->out);
+	return prog;
+}
+
+// Pops the (numeric) stack into r and destroys the program
+static void finish(postl_program_t *prog,result_t *r){
+	while(postl_stack_size(prog)>0){
+		postl_stackval_t val=postl_stack_pop(prog);
+		if(r->nvals<16)r->vals[r->nvals++]=val.type==POSTL_NUM?val.numv:-1;
+		postl_stackval_release(val);
+	}
+	postl_destroy(prog);
+}
+
+static bool expect_error(const char *what,const char *image,size_t size,const char *expect){
+	result_t r;
+	postl_program_t *prog=makeprogram(&r);
+	const char *errstr=postl_runcompiled(prog,image,size);
+	bool ok=errstr&&strcmp(errstr,expect)==0&&postl_stack_size(prog)==0&&r.out.len==0;
+	if(!ok)fprintf(stderr,"%s: expected '%s', got '%s'\n",what,expect,errstr?errstr:"(no error)");
+	postl_destroy(prog);
+	capture_free(&r.out);
+	return ok;
+}
+
+static void put32(char *p,uint32_t v){
+	memcpy(p,&v,4);
+}
+
+static uint32_t get32(const char *p){
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+// As the loader computes it, so that damage gets past it
+static uint32_t checksum(const char *data,size_t len){
+	uint64_t h=14695981039346656037u;
+	size_t i=0;
+	for(;i+8<=len;i+=8){
+		uint64_t w;
+		memcpy(&w,data+i,8);
+		h=(h^w)*1099511628211u;
+		h^=h>>29;
+	}
+	for(;i<len;i++)h=(h^(unsigned char)data[i])*1099511628211u;
+	return h^(h>>32);
+}
+
+static int noinput(void *ctx,char *buf,int size){
+	(void)ctx; (void)buf; (void)size;
+	return 0;
+}
+
+// returns the number of damaged images that were run
+static int run_mutated(const char *image,size_t size,char *copy){
+	int nrun=0;
+	srand(1);
+	for(int i=0;i<NMUTATIONS;i++){
+		memcpy(copy,image,size);
+		int nbytes=1+rand()%4;
+		for(int j=0;j<nbytes;j++){
+			size_t at=HEADERSIZE+rand()%(size-HEADERSIZE);
+			copy[at]=rand()%4==0?(char)0xff:copy[at]^(1<<rand()%8);
+		}
+		put32(copy+OFF_CHECKSUM,checksum(copy+HEADERSIZE,size-HEADERSIZE));
+		result_t r;
+		postl_program_t *prog=makeprogram(&r);
+		postl_set_input(prog,noinput,NULL);
+		postl_set_budget(prog,100000,0);
+		if(!postl_runcompiled(prog,copy,size))nrun++;
+		finish(prog,&r);
+		capture_free(&r.out);
+	}
+	return nrun;
+}
+
+int main(void){
+	result_t direct,loaded;
+	postl_program_t *prog=makeprogram(&direct);
+	const char *errstr=postl_runcode(prog,source);
+	if(errstr){
+		fprintf(stderr,"source: %s\n",errstr);
+		return 1;
+	}
+	finish(prog,&direct);
+
+	void *image;
+	size_t size;
+	prog=postl_makeprogram();
+	errstr=postl_compilecode(prog,source,strlen(source),&image,&size);
+	bool ok=postl_stack_size(prog)==0; // not run
+	postl_destroy(prog);
+	if(errstr||!ok){
+		fprintf(stderr,"compiling: %s\n",errstr?errstr:"the code was run");
+		return 1;
+	}
+
+	prog=makeprogram(&loaded);
+	errstr=postl_runcompiled(prog,image,size);
+	if(errstr){
+		fprintf(stderr,"running the image: %s\n",errstr);
+		return 1;
+	}
+	finish(prog,&loaded);
+	bool same=strcmp(capture_str(&direct.out),capture_str(&loaded.out))==0&&direct.nvals==loaded.nvals
+		&&memcmp(direct.vals,loaded.vals,direct.nvals*sizeof(double))==0;
+	capture_free(&direct.out);
+	capture_free(&loaded.out);
+	if(!same){
+		fprintf(stderr,"the image does something else than the source\n");
+		return 1;
+	}
+
+	prog=postl_makeprogram();
+	void *bad=NULL;
+	size_t badsize;
+	errstr=postl_compilecode(prog,"{ 1",3,&bad,&badsize);
+	postl_destroy(prog);
+	if(!errstr||bad){
+		fprintf(stderr,"compiling bad source: no error\n");
+		return 1;
+	}
+
+	char *copy=xmalloc(size+1);
+#define DAMAGED(what,damage,len,expect) \
+		memcpy(copy,image,size); \
+		damage; \
+		ok=expect_error(what,copy,len,expect)&&ok;
+
+	DAMAGED("wrong magic",copy[0]^=1,size,"postl: Not compiled postl code");
+	DAMAGED("too short for a header",(void)0,8,"postl: Not compiled postl code");
+	DAMAGED("wrong version",put32(copy+OFF_VERSION,get32(copy+OFF_VERSION)+1),size,
+		"postl: Compiled code is for a different version of postl");
+	DAMAGED("truncated",(void)0,size-1,"postl: Compiled code is truncated or has trailing data");
+	DAMAGED("trailing data",copy[size]=0,size+1,"postl: Compiled code is truncated or has trailing data");
+	DAMAGED("wrong section sizes",put32(copy+OFF_NSYMS,get32(copy+OFF_NSYMS)+1),size,
+		"postl: Compiled code is malformed");
+	DAMAGED("checksum mismatch",copy[size-1]^=0x20,size,"postl: Compiled code is corrupt (checksum mismatch)");
+	DAMAGED("checksum mismatch in the instructions",copy[size/2]^=1,size,
+		"postl: Compiled code is corrupt (checksum mismatch)");
+
+	if(!ok)return 1;
+
+	if(checksum((char*)image+HEADERSIZE,size-HEADERSIZE)!=get32((char*)image+OFF_CHECKSUM)){
+		fprintf(stderr,"the checksum isn't computed as expected\n");
+		return 1;
+	}
+	int nrun=run_mutated(image,size,copy);
+	printf("%d damaged images: %d rejected, %d run\n",NMUTATIONS,NMUTATIONS-nrun,nrun);
+	free(copy);
+	free(image);
+}
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <unistd.h>
+#include "testutil.h"
+
+// Runs the builtins that read input against the different kinds of input
+// source, up to and past the end of the input and past input too long to read
+// at once, and checks what they read.
+
+static const char *input="first line\nsecond\n  12 -3.5\n\tx7\nrest of it\nlast";
+
+static const char *script=
+	"readline print lf readline print lf\n"
+	"readnum pop print lf readnum pop print lf\n"
+	"getc ord print lf 3 read print lf readline strlen print lf\n"
+	"readall print lf\n"
+	// at the end of the input
+	"readline print lf getc print lf 1 read print lf readall strlen print lf readnum print lf\n";
+
+static const char *expect=
+	"first line\nsecond\n"
+	"12\n-3.5\n"
+	"10\n\tx7\n0\n"
+	"rest of it\nlast\n"
+	"-1\n-1\n-1\n0\n0\n";
+
+typedef struct chunks_t{
+	const char *data;
+	int pos,len,size;
+	const char *out; // must have been flushed before each read
+} chunks_t;
+
+#define INBUF_MAX (1<<30) // as in postl.c: more unread input is too long
+
+static capture_t out;
+static bool ok=true;
+
+// Hands out the input a few bytes at a time
+static int source_chunks(void *ctx,char *buf,int size){
+	chunks_t *c=(chunks_t*)ctx;
+	if(c->out&&strstr(capture_str(&out),c->out)==NULL){
+		fprintf(stderr,"output not flushed before reading\n");
+		ok=false;
+	}
+	int n=c->len-c->pos;
+	if(n>c->size)n=c->size;
+	if(n>size)n=size;
+	memcpy(buf,c->data+c->pos,n);
+	c->pos+=n;
+	return n;
+}
+
+// A line, then more than the input buffer holds without a newline
+static const char *longhead="12 line\n";
+
+static int source_long(void *ctx,char *buf,int size){
+	long *sent=(long*)ctx;
+	if(*sent>INBUF_MAX)return 0;
+	int n=0;
+	if(*sent==0){
+		n=strlen(longhead);
+		memcpy(buf,longhead,n);
+	}
+	memset(buf+n,'x',size-n);
+	*sent+=size;
+	return size;
+}
+
+static postl_program_t* makeprogram(void){
+	capture_clear(&out);
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_output(prog,capture_sink,&out);
+	return prog;
+}
+
+static void check(const char *what,postl_program_t *prog,const char *source,const char *expecterr,const char *expectout){
+	const char *errstr=postl_runcode(prog,source);
+	if(expecterr?!errstr||strcmp(errstr,expecterr)!=0:errstr!=NULL){
+		fprintf(stderr,"%s: expected error '%s', got '%s'\n",what,expecterr?expecterr:"(none)",errstr?errstr:"(none)");
+		ok=false;
+	}
+	if(strcmp(capture_str(&out),expectout)!=0){
+		fprintf(stderr,"%s: expected output\n%s\ngot\n%s\n",what,expectout,capture_str(&out));
+		ok=false;
+	}
+	postl_destroy(prog);
+}
+
+int main(void){
+	for(int size=1;size<=8;size++){
+		chunks_t c={input,0,strlen(input),size,NULL};
+		postl_program_t *prog=makeprogram();
+		postl_set_input(prog,source_chunks,&c);
+		char what[32];
+		snprintf(what,sizeof(what),"%d-byte chunks",size);
+		check(what,prog,script,NULL,expect);
+	}
+
+	FILE *f=tmpfile();
+	if(!f||fputs(input,f)<0||fseek(f,0,SEEK_SET)!=0){
+		fprintf(stderr,"Cannot write temporary file\n");
+		return 1;
+	}
+	postl_program_t *prog=makeprogram();
+	postl_set_input_file(prog,f);
+	check("file",prog,script,NULL,expect);
+	fclose(f);
+
+	int fds[2];
+	if(pipe(fds)!=0||write(fds[1],input,strlen(input))!=(ssize_t)strlen(input)){
+		fprintf(stderr,"Cannot make pipe\n");
+		return 1;
+	}
+	close(fds[1]);
+	prog=makeprogram();
+	postl_set_input_fd(prog,fds[0]);
+	check("fd",prog,script,NULL,expect);
+	close(fds[0]);
+
+	// A prompt is flushed before the program waits for input
+	chunks_t c={"42\n",0,3,1,"name? "};
+	prog=makeprogram();
+	postl_set_input(prog,source_chunks,&c);
+	check("prompt",prog,"\"name? \" print readline print lf",NULL,"name? 42\n");
+
+	c=(chunks_t){"1 2x 3",0,6,2,NULL};
+	prog=makeprogram();
+	postl_set_input(prog,source_chunks,&c);
+	check("non-numeric",prog,"readnum pop print lf readnum",
+		"postl: Invalid number in input in 'readnum'","1\n");
+
+	c=(chunks_t){"abc",0,3,2,NULL};
+	prog=makeprogram();
+	postl_set_input(prog,source_chunks,&c);
+	check("bad count",prog,"-1 read","postl: Invalid byte count in 'read'","");
+
+	// A source may have more input after saying it has ended, if it's set again
+	c=(chunks_t){"a",0,1,1,NULL};
+	prog=makeprogram();
+	postl_set_input(prog,source_chunks,&c);
+	if(postl_runcode(prog,"getc print getc print lf"))ok=false;
+	c=(chunks_t){"b",0,1,1,NULL};
+	postl_set_input(prog,source_chunks,&c);
+	check("set again",prog,"getc print lf",NULL,"a-1\nb\n");
+
+	// Input that's too long for 'readall' can still be read a line at a time
+	long sent=0;
+	prog=makeprogram();
+	postl_set_input(prog,source_long,&sent);
+	const char *errstr=postl_runcode(prog,"readall");
+	if(!errstr||strcmp(errstr,"postl: Input too long in 'readall'")!=0){
+		fprintf(stderr,"long input: expected 'readall' to fail, got '%s'\n",errstr?errstr:"(none)");
+		ok=false;
+	}
+	check("after long input",prog,"readnum pop print lf readline print lf",NULL,"12\n line\n");
+
+	capture_free(&out);
+	return ok?0:1;
+}
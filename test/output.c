@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <math.h>
+#include "testutil.h"
+
+// Checks that printed numbers come out as printf("%g") would write them, and
+// that a custom sink gets all output in order, however it's batched.
+
+#define BIGLEN 100000 // more than the output buffer holds
+
+static capture_t out;
+static bool ok=true;
+
+// Writes a mark straight into the captured output, bypassing the program's
+static void mark(postl_program_t *prog){
+	(void)prog;
+	capture_sink(&out,"|",1);
+}
+
+static postl_program_t* makeprogram(void){
+	capture_clear(&out);
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_output(prog,capture_sink,&out);
+	postl_register(prog,"mark",mark);
+	return prog;
+}
+
+static void run(const char *what,postl_program_t *prog,const char *source){
+	const char *errstr=postl_runcode(prog,source);
+	if(errstr){
+		fprintf(stderr,"%s: %s\n",what,errstr);
+		ok=false;
+	}
+}
+
+static void check_numbers(void){
+	static const double nums[]={
+		0,1,-1,7,-7,42,-0.5,0.5,-1e-5,1e-5,0.1,-0.001,1.5,-2.25,
+		99999,-99999,999999,-999999,999999.4,999999.5,-999999.5,1000000,-1000000,1e6+1,
+		123456.7,2147483647,-2147483648.0,4294967296.0,1e15,1e300,-1e-300,5e-324,1.7976931348623157e308,
+	};
+	int n=sizeof(nums)/sizeof(nums[0]);
+	double all[sizeof(nums)/sizeof(nums[0])+4];
+	memcpy(all,nums,sizeof(nums));
+	all[n++]=-0.0;
+	all[n++]=NAN;
+	all[n++]=INFINITY;
+	all[n++]=-INFINITY;
+
+	for(int i=0;i<n;i++){
+		postl_program_t *prog=makeprogram();
+		postl_stack_push(prog,postl_stackval_makenum(all[i]));
+		run("number",prog,"print");
+		postl_destroy(prog);
+		char expect[64];
+		snprintf(expect,sizeof(expect),"%g",all[i]);
+		if(strcmp(capture_str(&out),expect)!=0){
+			fprintf(stderr,"printing %.17g: expected '%s', got '%s'\n",all[i],expect,capture_str(&out));
+			ok=false;
+		}
+	}
+
+	// Numbers worked out by scripts, which is where -0 comes from
+	postl_program_t *prog=makeprogram();
+	run("computed numbers",prog,"0 -1 * print \" \" print 1 3 / print \" \" print 0 0 / 0 < print \" \" print 2 10000 pow print");
+	postl_destroy(prog);
+	char expect[128];
+	snprintf(expect,sizeof(expect),"%g %g 0 %g",-0.0,1.0/3,INFINITY);
+	if(strcmp(capture_str(&out),expect)!=0){
+		fprintf(stderr,"printing computed numbers: expected '%s', got '%s'\n",expect,capture_str(&out));
+		ok=false;
+	}
+}
+
+static void check_order(void){
+	// 'flush' hands over what's printed so far
+	postl_program_t *prog=makeprogram();
+	run("flush",prog,"1 print flush 2 print flush 3 print");
+	if(strcmp(capture_str(&out),"123")!=0||out.nwrites!=3){
+		fprintf(stderr,"flush: got '%s' in %d batches\n",capture_str(&out),out.nwrites);
+		ok=false;
+	}
+
+	// Output is handed over before a C function is called, and before and
+	// after a string that doesn't fit in the buffer
+	char *big=xmalloc(BIGLEN+1);
+	memset(big,'x',BIGLEN);
+	big[BIGLEN]='\0';
+	capture_clear(&out);
+	postl_stackval_t bigval=postl_stackval_makestr(big);
+	postl_stack_push(prog,bigval);
+	postl_stackval_release(bigval);
+	run("big string",prog,"\"big\" def \"a\" print mark \"b\" print big print \"c\" print mark 1 dup 20000 < { dup print 1 + dup 20000 < } while pop \"d\" print");
+	postl_destroy(prog);
+
+	size_t cap=BIGLEN+200000,len=0;
+	char *expect=xmalloc(cap);
+	len+=snprintf(expect+len,cap-len,"a|b%sc|",big);
+	for(int i=1;i<20000;i++)len+=snprintf(expect+len,cap-len,"%d",i);
+	len+=snprintf(expect+len,cap-len,"d");
+	if(out.len!=len||memcmp(capture_str(&out),expect,len)!=0){
+		fprintf(stderr,"output out of order (%zu bytes, expected %zu)\n",out.len,len);
+		ok=false;
+	}
+	free(expect);
+	free(big);
+}
+
+int main(void){
+	check_numbers();
+	check_order();
+	capture_free(&out);
+	return ok?0:1;
+}
@@ -1,33 +1,38 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "../postl.h"
 
-// TODO: fix null chars in the file
-char* readfile(const char *fname){
-	FILE *f=fopen(fname,"rb");
-	if(!f)return NULL;
-	if(fseek(f,0,SEEK_END)==-1){fclose(f); return NULL;}
-	long flen=ftell(f);
-	if(flen==-1){fclose(f); return NULL;}
-	rewind(f);
-	char *buf=malloc(flen+1);
-	if(!buf){fclose(f); return NULL;}
-	fread(buf,1,flen,f);
-	if(ferror(f)){fclose(f); free(buf); return NULL;}
-	buf[flen]='\0';
-	fclose(f);
+// The source is mapped rather than read, and postl_runcode_n doesn't copy it,
+// so large scripts are never copied as a whole. Returns NULL on error; an
+// empty file gives a non-NULL pointer that mustn't be unmapped.
+char* mapfile(const char *fname,size_t *lenp){
+	int fd=open(fname,O_RDONLY);
+	if(fd==-1)return NULL;
+	struct stat st;
+	if(fstat(fd,&st)==-1){close(fd); return NULL;}
+	*lenp=st.st_size;
+	if(*lenp==0){close(fd); return "";}
+	char *buf=mmap(NULL,*lenp,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(buf==MAP_FAILED)return NULL;
 	return buf;
 }
 
-char *readstdin(void){
-	int bufsz=1024,cursor=0;
+char *readstdin(size_t *lenp){
+	size_t bufsz=1024,cursor=0;
 	char *buf=malloc(bufsz);
 	if(!buf)return NULL;
 	while(true){
-		if(cursor==bufsz-1){
+		if(cursor==bufsz){
 			bufsz*=2;
 			char *newbuf=realloc(buf,bufsz);
 			if(!newbuf){
@@ -36,9 +41,9 @@ char *readstdin(void){
 			}
 			buf=newbuf;
 		}
-		int nread=fread(buf,1,bufsz-cursor-1,stdin);
+		size_t nread=fread(buf+cursor,1,bufsz-cursor,stdin);
 		cursor+=nread;
-		if(nread<bufsz-cursor-1){
+		if(nread==0){
 			if(feof(stdin))break;
 			if(ferror(stdin)){
 				free(buf);
@@ -46,24 +51,141 @@ char *readstdin(void){
 			}
 		}
 	}
-	buf[cursor]='\0';
+	*lenp=cursor;
 	return buf;
 }
 
+static int cmpstr(const void *a,const void *b){
+	return strcmp(*(char*const*)a,*(char*const*)b);
+}
+
+// Runs every .psl file in dir as a job on a pool of workers, and prints their
+// output in order of file name once each is done. The scripts read from an
+// empty input.
+int runbatch(const char *dir,int nworkers){
+	DIR *d=opendir(dir);
+	if(!d){
+		fprintf(stderr,"Cannot open directory '%s'\n",dir);
+		return 1;
+	}
+	char **names=NULL;
+	int nnames=0,namescap=0;
+	struct dirent *de;
+	while((de=readdir(d))){
+		size_t len=strlen(de->d_name);
+		if(len<=4||strcmp(de->d_name+len-4,".psl")!=0)continue;
+		if(nnames==namescap){
+			namescap=namescap==0?64:2*namescap;
+			names=realloc(names,namescap*sizeof(char*));
+			if(!names){
+				fprintf(stderr,"Out of memory\n");
+				return 1;
+			}
+		}
+		names[nnames]=malloc(strlen(dir)+len+2);
+		if(!names[nnames]){
+			fprintf(stderr,"Out of memory\n");
+			return 1;
+		}
+		sprintf(names[nnames++],"%s/%s",dir,de->d_name);
+	}
+	closedir(d);
+	qsort(names,nnames,sizeof(char*),cmpstr);
+
+	postl_pool_t *pool=postl_pool_make(nworkers,NULL);
+	postl_job_t **jobs=malloc((nnames>0?nnames:1)*sizeof(postl_job_t*));
+	if(!jobs){
+		fprintf(stderr,"Out of memory\n");
+		return 1;
+	}
+	for(int i=0;i<nnames;i++){
+		size_t sourcelen;
+		char *source=mapfile(names[i],&sourcelen);
+		jobs[i]=NULL;
+		if(!source)continue;
+		jobs[i]=postl_pool_submit(pool,source,sourcelen,0,NULL);
+		if(sourcelen>0)munmap(source,sourcelen);
+	}
+
+	int failed=0;
+	for(int i=0;i<nnames;i++){
+		printf("==> %s <==\n",names[i]);
+		if(!jobs[i]){
+			fflush(stdout);
+			fprintf(stderr,"Cannot read file '%s'\n",names[i]);
+			failed++;
+			free(names[i]);
+			continue;
+		}
+		size_t outlen;
+		const char *output=postl_job_output(jobs[i],&outlen);
+		fwrite(output,1,outlen,stdout);
+		const char *errstr=postl_job_wait(jobs[i]);
+		if(errstr){
+			fflush(stdout);
+			fprintf(stderr,"\x1B[31m%s\x1B[0m\n",errstr);
+			failed++;
+		}
+		postl_job_release(jobs[i]);
+		free(names[i]);
+	}
+	fflush(stdout);
+	postl_pool_destroy(pool);
+	free(jobs);
+	free(names);
+	if(failed>0){
+		fprintf(stderr,"%d of %d scripts failed\n",failed,nnames);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc,char **argv){
-	if(argc!=2){
-		fprintf(stderr,"Pass postl file as command-line argument\n");
+	// -p: print the hottest instruction sequences afterwards (see runpostl-profile)
+	// -c out: compile the file and save the compiled code in out, without running it
+	// -b: the file is compiled code saved with -c
+	// -j n: the argument is a directory; run all its scripts on n threads
+	// -t secs: stop the script if it runs longer than that
+	bool profile=false,compiled=false;
+	const char *saveto=NULL;
+	int nworkers=0;
+	double timelimit=0;
+	while(argc>2&&argv[1][0]=='-'&&argv[1][1]!='\0'){
+		if(strcmp(argv[1],"-p")==0)profile=true;
+		else if(strcmp(argv[1],"-b")==0)compiled=true;
+		else if(strcmp(argv[1],"-c")==0&&argc>3){
+			saveto=argv[2];
+			argv++;
+			argc--;
+		} else if(strcmp(argv[1],"-j")==0&&argc>3&&atoi(argv[2])>0){
+			nworkers=atoi(argv[2]);
+			argv++;
+			argc--;
+		} else if(strcmp(argv[1],"-t")==0&&argc>3&&atof(argv[2])>0){
+			timelimit=atof(argv[2]);
+			argv++;
+			argc--;
+		} else break;
+		argv++;
+		argc--;
+	}
+	if(argc!=2||(saveto&&compiled)||(nworkers>0&&(saveto||compiled||profile||timelimit>0))){
+		fprintf(stderr,"Usage: %s [-p] [-b] [-c out] [-t secs] <file.psl | ->\n",argv[0]);
+		fprintf(stderr,"       %s -j nthreads <dir>\n",argv[0]);
 		return 1;
 	}
+	if(nworkers>0)return runbatch(argv[1],nworkers);
 	char *source;
-	if(strcmp(argv[1],"-")==0){
-		source=readstdin();
+	size_t sourcelen;
+	bool mapped=strcmp(argv[1],"-")!=0;
+	if(!mapped){
+		source=readstdin(&sourcelen);
 		if(!source){
 			fprintf(stderr,"Cannot read from stdin\n");
 			return 1;
 		}
 	} else {
-		source=readfile(argv[1]);
+		source=mapfile(argv[1],&sourcelen);
 		if(!source){
 			fprintf(stderr,"Cannot read file '%s'\n",argv[1]);
 			return 1;
@@ -73,7 +195,29 @@ int main(int argc,char **argv){
 	const char *errstr;
 
 	postl_program_t *prog=postl_makeprogram();
-	if((errstr=postl_runcode(prog,source))){
+	postl_set_budget(prog,0,timelimit);
+	if(saveto){
+		void *image;
+		size_t imagelen;
+		errstr=postl_compilecode(prog,source,sourcelen,&image,&imagelen);
+		if(!errstr){
+			FILE *f=fopen(saveto,"wb");
+			bool ok=f&&fwrite(image,1,imagelen,f)==imagelen;
+			if(f&&fclose(f)!=0)ok=false;
+			free(image);
+			if(!ok){
+				fprintf(stderr,"Cannot write file '%s'\n",saveto);
+				postl_destroy(prog);
+				return 1;
+			}
+		}
+	} else if(compiled)errstr=postl_runcompiled(prog,source,sourcelen);
+	else errstr=postl_runcode_n(prog,source,sourcelen);
+	if(mapped){
+		if(sourcelen>0)munmap(source,sourcelen);
+	} else free(source);
+	if(profile)postl_profile_report(prog,20);
+	if(errstr){
 		fprintf(stderr,"\x1B[31m%s\x1B[0m\n",errstr);
 		postl_destroy(prog);
 		return 1;
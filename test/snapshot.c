@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// Defines a library in one program, snapshots it, and runs requests in
+// programs made from the snapshot on several threads; checks that the
+// requests can't see each other's changes, and compares the cost of a
+// program made from the snapshot with running the library again. Also checks
+// that restoring a program drops what it cached from its earlier state.
+
+#define NFUNCS 2000
+#define ROUNDS 2000
+
+static const char *request=
+	// changes library state, which must not leak into other requests
+	"counter 1 + \"counter\" gdef\n"
+	"greeting \", world\" + \"greeting\" gdef\n"
+	"{ 0 } \"f7\" def\n"
+	"5 f1999 f7 counter greeting strlen swap pop\n";
+
+static char *library;
+
+static void build_library(void){
+	size_t cap=64*NFUNCS+256,len=0;
+	library=xmalloc(cap);
+	len+=snprintf(library+len,cap-len,"0 \"counter\" def \"hello\" \"greeting\" def\n");
+	for(int i=0;i<NFUNCS;i++){
+		len+=snprintf(library+len,cap-len,"{ \"x\" def x %d + 2 * } \"f%d\" def\n",i,i);
+	}
+}
+
+static bool check_request(postl_program_t *prog,int id){
+	const char *errstr=postl_runcode(prog,request);
+	if(errstr){
+		fprintf(stderr,"thread %d: %s\n",id,errstr);
+		return false;
+	}
+	double expect[]={(5+1999)*2,0,1,12};
+	bool ok=postl_stack_size(prog)==4;
+	for(int i=3;i>=0&&ok;i--){
+		postl_stackval_t val=postl_stack_pop(prog);
+		ok=val.type==POSTL_NUM&&val.numv==expect[i];
+		postl_stackval_release(val);
+	}
+	if(!ok)fprintf(stderr,"thread %d: wrong result\n",id);
+	return ok;
+}
+
+typedef struct job_t{
+	int id;
+	const postl_snapshot_t *snap;
+	bool ok;
+} job_t;
+
+static void* thread_main(void *arg){
+	job_t *job=(job_t*)arg;
+	job->ok=true;
+	for(int i=0;i<ROUNDS&&job->ok;i++){
+		postl_program_t *prog=postl_snapshot_makeprogram(job->snap);
+		job->ok=check_request(prog,job->id);
+		postl_destroy(prog);
+	}
+	// One program, restored between requests
+	postl_program_t *prog=postl_snapshot_makeprogram(job->snap);
+	for(int i=0;i<ROUNDS&&job->ok;i++){
+		job->ok=check_request(prog,job->id);
+		postl_restore(prog,job->snap);
+	}
+	postl_destroy(prog);
+	return NULL;
+}
+
+// A one-character string is cached in the program, and freezing the program
+// freezes it too; restoring to another snapshot releases it
+static bool check_restore_chars(void){
+	capture_t out={0};
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_output(prog,capture_sink,&out);
+	const char *errstr=postl_runcode(prog,"97 chr");
+	postl_snapshot_destroy(postl_snapshot(prog));
+	postl_program_t *other=postl_makeprogram();
+	postl_snapshot_t *snap=postl_snapshot(other);
+	postl_destroy(other);
+	postl_restore(prog,snap);
+	postl_snapshot_destroy(snap);
+	if(!errstr)errstr=postl_runcode(prog,"97 chr print lf");
+	postl_destroy(prog);
+	bool ok=!errstr&&strcmp(capture_str(&out),"a\n")==0;
+	if(!ok)fprintf(stderr,"restoring with cached characters: %s\n",errstr?errstr:capture_str(&out));
+	capture_free(&out);
+	return ok;
+}
+
+int main(int argc,char **argv){
+	int nthreads=nthreads_arg(argc,argv,4);
+	if(!check_restore_chars())return 1;
+	build_library();
+
+	double start=now();
+	postl_program_t *base=postl_makeprogram();
+	const char *errstr=postl_runcode(base,library);
+	if(errstr){
+		fprintf(stderr,"%s\n",errstr);
+		return 1;
+	}
+	double fromscratch=now()-start;
+	postl_snapshot_t *snap=postl_snapshot(base);
+
+	// The original program goes on independently, and may go first
+	errstr=postl_runcode(base,"1000 \"counter\" gdef \"bye\" \"greeting\" gdef { 1 } \"f1999\" def");
+	if(errstr){
+		fprintf(stderr,"%s\n",errstr);
+		return 1;
+	}
+	postl_destroy(base);
+
+	start=now();
+	for(int i=0;i<ROUNDS;i++)postl_destroy(postl_snapshot_makeprogram(snap));
+	double fromsnap=(now()-start)/ROUNDS;
+
+	pthread_t *threads=xmalloc(nthreads*sizeof(pthread_t));
+	job_t *jobs=xmalloc(nthreads*sizeof(job_t));
+	for(int i=0;i<nthreads;i++){
+		jobs[i].id=i;
+		jobs[i].snap=snap;
+		start_thread(&threads[i],thread_main,&jobs[i]);
+	}
+	bool ok=true;
+	for(int i=0;i<nthreads;i++){
+		pthread_join(threads[i],NULL);
+		ok=ok&&jobs[i].ok;
+	}
+	postl_snapshot_destroy(snap);
+	free(threads);
+	free(jobs);
+	free(library);
+	if(!ok)return 1;
+
+	printf("%d definitions: running the library %.1f us; program from snapshot %.1f us\n",
+		NFUNCS,fromscratch*1e6,fromsnap*1e6);
+}
@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <unistd.h>
+#include "testutil.h"
+
+// Runs independent programs on several threads at once, checks that none of
+// them see each other's state, and compares throughput with a single thread:
+// fails if the threads together get less than half the ideal speedup, which
+// is the number of threads or of cores, whichever is less.
+
+#define ROUNDS 100
+
+static const char *workload=
+	"{ \"n\" def 0 n dup 0 > { 1 - swap 1 + swap dup 0 > } while pop } \"count\" def\n"
+	"{ \"n\" def \"\" n 0 > { \"ab\" + n 1 - \"n\" gdef n 0 > } while } \"strs\" def\n"
+	"20000 count\n"
+	"30 strs strlen swap pop\n"
+	"double\n";
+
+static void double_top(postl_program_t *prog){
+	postl_stackval_t val=postl_stack_pop(prog);
+	val.numv*=2;
+	postl_stack_push(prog,val);
+}
+
+typedef struct job_t{
+	int id;
+	bool ok;
+} job_t;
+
+static bool run_one(int id){
+	postl_program_t *prog=postl_makeprogram();
+	postl_register(prog,"double",double_top);
+	bool ok=true;
+	const char *errstr=postl_runcode(prog,workload);
+	if(errstr){
+		fprintf(stderr,"thread %d: %s\n",id,errstr);
+		ok=false;
+	} else if(postl_stack_size(prog)!=2){
+		fprintf(stderr,"thread %d: stack size %d\n",id,postl_stack_size(prog));
+		ok=false;
+	} else {
+		postl_stackval_t b=postl_stack_pop(prog),a=postl_stack_pop(prog);
+		if(a.type!=POSTL_NUM||a.numv!=20000||b.type!=POSTL_NUM||b.numv!=120){
+			fprintf(stderr,"thread %d: wrong result\n",id);
+			ok=false;
+		}
+		postl_stackval_release(a);
+		postl_stackval_release(b);
+	}
+
+	// Error strings belong to the program that produced them
+	char name[32],expect[128];
+	snprintf(name,sizeof(name),"missing%d",id);
+	snprintf(expect,sizeof(expect),"postl: function or variable '%s' not found",name);
+	errstr=postl_runcode(prog,name);
+	if(!errstr||strcmp(errstr,expect)!=0){
+		fprintf(stderr,"thread %d: unexpected error '%s'\n",id,errstr?errstr:"(null)");
+		ok=false;
+	}
+	postl_destroy(prog);
+	return ok;
+}
+
+static void* thread_main(void *arg){
+	job_t *job=(job_t*)arg;
+	job->ok=true;
+	for(int i=0;i<ROUNDS;i++)job->ok=run_one(job->id)&&job->ok;
+	return NULL;
+}
+
+// returns the wall time taken, or -1 on failure
+static double run_threads(int nthreads){
+	pthread_t *threads=xmalloc(nthreads*sizeof(pthread_t));
+	job_t *jobs=xmalloc(nthreads*sizeof(job_t));
+	double start=now();
+	for(int i=0;i<nthreads;i++){
+		jobs[i].id=i;
+		start_thread(&threads[i],thread_main,&jobs[i]);
+	}
+	bool ok=true;
+	for(int i=0;i<nthreads;i++){
+		pthread_join(threads[i],NULL);
+		ok=ok&&jobs[i].ok;
+	}
+	double taken=now()-start;
+	free(threads);
+	free(jobs);
+	return ok?taken:-1;
+}
+
+int main(int argc,char **argv){
+	int nthreads=nthreads_arg(argc,argv,4);
+
+	double single=run_threads(1);
+	if(single<0)return 1;
+	double multi=run_threads(nthreads);
+	if(multi<0)return 1;
+	long ncores=sysconf(_SC_NPROCESSORS_ONLN);
+	int ideal=ncores>0&&ncores<nthreads?(int)ncores:nthreads;
+	double speedup=nthreads*single/multi;
+	printf("1 thread: %.3fs; %d threads: %.3fs; speedup %.2fx (ideal %d)\n",
+		single,nthreads,multi,speedup,ideal);
+	// Nothing to compare with one thread or one core
+	if(ideal>1&&speedup<0.5*ideal){
+		fprintf(stderr,"threads don't scale: speedup %.2fx, expected at least %.2fx\n",speedup,0.5*ideal);
+		return 1;
+	}
+}
@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// Strings share buffers: a substr is a slice of its parent, and appending to a
+// string that ends where its buffer's used part ends writes into the buffer
+// even when the string is shared. Checks that no holder of a string ever sees
+// it change, including holders in programs made from a snapshot.
+
+typedef struct check_t{
+	const char *what,*source,*expect;
+} check_t;
+
+static const check_t checks[]={
+	{"two holders append different suffixes",
+		"10 strbuf \"x\" + \"s\" def\n"
+		"s \"1\" + \"a\" def s \"2\" + \"b\" def s \"3\" + \"c\" def\n"
+		"a \"z\" + \"d\" def b \"w\" + \"e\" def\n"
+		"s print \" \" print a print \" \" print b print \" \" print c print \" \" print d print \" \" print e print",
+		"x x1 x2 x3 x1z x2w"},
+	{"appending in a loop through a variable",
+		"\"\" \"s\" def \"\" \"t\" def 0 dup 100 < { s \"ab\" + \"s\" gdef t \"a\" + \"t\" gdef 1 + dup 100 < } while pop\n"
+		"s strlen print \" \" print t strlen print \" \" print s 198 2 substr print t 0 3 substr print",
+		"200 100 abaaa"},
+	{"substr of a string that's appended to later",
+		"10 strbuf \"hello\" + \"s\" def s 1 3 substr \"t\" def\n"
+		"s \" world\" + \"u\" def t \"!\" + \"v\" def\n"
+		"s print \" \" print t print \" \" print u print \" \" print v print",
+		"hello ell hello world ell!"},
+	{"appending to a substr at the end of the used part",
+		"10 strbuf \"abc\" + \"s\" def s 1 2 substr \"!\" + \"t\" def s \"?\" + \"u\" def t \"-\" + \"v\" def\n"
+		"s print \" \" print t print \" \" print u print \" \" print v print",
+		"abc bc! abc? bc!-"},
+	{"appending to a string with NULs",
+		"0 chr \"z\" + \"s\" def s s + \"t\" def s strlen print \" \" print t strlen print \" \" print t 2 1 substr ord print",
+		"2 4 0"},
+};
+
+// The snapshot is of a program holding strings with room to append to them;
+// they're frozen, so appends must copy
+static const char *library=
+	"10 strbuf \"abc\" + \"s\" gdef s 1 2 substr \"t\" gdef\n";
+
+static const char *request=
+	"s \"%d\" + \"a\" def t \"%d\" + \"b\" def s \"!\" + \"c\" def\n"
+	"s print \" \" print t print \" \" print a print \" \" print b print \" \" print c print";
+
+static capture_t out;
+
+static bool run(postl_program_t *prog,const char *what,const char *source,const char *expect){
+	capture_clear(&out);
+	postl_set_output(prog,capture_sink,&out);
+	const char *errstr=postl_runcode(prog,source);
+	if(errstr||strcmp(capture_str(&out),expect)!=0){
+		fprintf(stderr,"%s: expected '%s', got '%s'\n",what,expect,errstr?errstr:capture_str(&out));
+		return false;
+	}
+	return true;
+}
+
+int main(void){
+	bool ok=true;
+	int n=sizeof(checks)/sizeof(checks[0]);
+	for(int i=0;i<n;i++){
+		postl_program_t *prog=postl_makeprogram();
+		ok=run(prog,checks[i].what,checks[i].source,checks[i].expect)&&ok;
+		postl_destroy(prog);
+	}
+
+	postl_program_t *base=postl_makeprogram();
+	const char *errstr=postl_runcode(base,library);
+	if(errstr){
+		fprintf(stderr,"library: %s\n",errstr);
+		return 1;
+	}
+	postl_snapshot_t *snap=postl_snapshot(base);
+	postl_program_t *progs[3]={base,postl_snapshot_makeprogram(snap),postl_snapshot_makeprogram(snap)};
+	postl_snapshot_destroy(snap);
+	for(int round=0;round<2;round++){
+		for(int i=0;i<3;i++){
+			char source[256],expect[64];
+			int k=10*round+i;
+			snprintf(source,sizeof(source),request,k,k);
+			snprintf(expect,sizeof(expect),"abc bc abc%d bc%d abc!",k,k);
+			ok=run(progs[i],"appending to frozen strings",source,expect)&&ok;
+		}
+	}
+	for(int i=0;i<3;i++)postl_destroy(progs[i]);
+	capture_free(&out);
+	return ok?0:1;
+}
@@ -0,0 +1,89 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+// Helpers shared by the test and benchmark drivers. Each driver is a single
+// file, so everything here is static inline. Drivers define _POSIX_C_SOURCE
+// before including anything.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../postl.h"
+
+static inline double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// exits when out of memory
+static inline void* xmalloc(size_t size){
+	void *p=malloc(size);
+	if(!p){
+		fprintf(stderr,"Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+// exits when the thread can't be created
+static inline void start_thread(pthread_t *thread,void* (*func)(void*),void *arg){
+	if(pthread_create(thread,NULL,func,arg)!=0){
+		fprintf(stderr,"Cannot create thread\n");
+		exit(1);
+	}
+}
+
+// For drivers taking an optional thread count as their only argument; exits
+// with a usage message if it's not a positive number
+static inline int nthreads_arg(int argc,char **argv,int nthreads){
+	if(argc>2||(argc==2&&(nthreads=atoi(argv[1]))<=0)){
+		fprintf(stderr,"Usage: %s [nthreads]\n",argv[0]);
+		exit(1);
+	}
+	return nthreads;
+}
+
+// An output sink that collects everything printed, NUL-terminated
+typedef struct capture_t{
+	char *buf; // NULL until something is written
+	size_t len,cap;
+	int nwrites; // times the sink was called
+} capture_t;
+
+static inline void capture_sink(void *ctx,const char *data,int len){
+	capture_t *c=(capture_t*)ctx;
+	if(c->len+len+1>c->cap){
+		c->cap=2*(c->len+len+1);
+		c->buf=realloc(c->buf,c->cap);
+		if(!c->buf){
+			fprintf(stderr,"Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(c->buf+c->len,data,len);
+	c->len+=len;
+	c->buf[c->len]='\0';
+	c->nwrites++;
+}
+
+static inline const char* capture_str(const capture_t *c){
+	return c->buf?c->buf:"";
+}
+
+static inline void capture_clear(capture_t *c){
+	c->len=0;
+	c->nwrites=0;
+	if(c->buf)c->buf[0]='\0';
+}
+
+static inline void capture_free(capture_t *c){
+	free(c->buf);
+	c->buf=NULL;
+	c->len=c->cap=0;
+	c->nwrites=0;
+}
+
+#endif
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include "testutil.h"
+
+// Runs a few long scripts queued ahead of many short ones on a few threads,
+// once running each to the end and once time-slicing them with instruction
+// budgets, and compares how long the short ones wait. A script that never
+// stops is dropped after a number of slices. Also checks that long code
+// without blocks or loops is sliced too, and that a script can be interrupted
+// from another thread.
+
+#define NLONG 8
+#define NSHORT 200
+#define LONGN 1000000 // loop rounds in a long script
+#define SHORTN 1000
+#define SLICE 10000 // instructions
+#define MAXSLICES 2000 // after which a script is dropped
+#define STRAIGHTN 100000 // '1 +'s in a script without blocks
+
+static const char *counter=
+	"{ \"n\" def 0 n dup 0 > { 1 - swap 1 + swap dup 0 > } while pop } \"count\" def\n";
+
+typedef struct task_t{
+	char source[64];
+	postl_program_t *prog;
+	bool started,runaway;
+	int slices,expect;
+	double finished; // seconds after the start; -1 if dropped
+} task_t;
+
+static task_t tasks[NLONG+NSHORT+1];
+static int ntasks;
+
+// Round-robin queue of tasks shared by the threads
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static task_t *queue[NLONG+NSHORT+1];
+static int qhead,qlen;
+static bool sliced,ok;
+static double start;
+
+static void fail(const char *msg,const char *detail){
+	pthread_mutex_lock(&lock);
+	fprintf(stderr,"%s: %s\n",msg,detail);
+	ok=false;
+	pthread_mutex_unlock(&lock);
+}
+
+static void add_task(const char *source,int expect,bool runaway){
+	task_t *t=&tasks[ntasks++];
+	snprintf(t->source,sizeof(t->source),"%s",source);
+	t->prog=postl_makeprogram();
+	const char *errstr=postl_runcode(t->prog,counter);
+	if(errstr)fail("library",errstr);
+	postl_set_budget(t->prog,sliced?SLICE:0,0);
+	t->started=false;
+	t->runaway=runaway;
+	t->slices=0;
+	t->expect=expect;
+	t->finished=-1;
+	queue[qlen++]=t;
+}
+
+static void* thread_main(void *arg){
+	(void)arg;
+	while(true){
+		pthread_mutex_lock(&lock);
+		if(qlen==0){
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		task_t *t=queue[qhead];
+		qhead=(qhead+1)%(NLONG+NSHORT+1);
+		qlen--;
+		pthread_mutex_unlock(&lock);
+
+		postl_status_t status;
+		if(!t->started){
+			t->started=true;
+			status=postl_runcode_step(t->prog,t->source,strlen(t->source));
+		} else status=postl_resume(t->prog);
+		t->slices++;
+		if(status==POSTL_PREEMPTED&&t->slices<MAXSLICES){
+			pthread_mutex_lock(&lock);
+			queue[(qhead+qlen++)%(NLONG+NSHORT+1)]=t;
+			pthread_mutex_unlock(&lock);
+			continue;
+		}
+		if(status==POSTL_PREEMPTED){
+			if(!t->runaway)fail("dropped",t->source);
+			postl_abandon(t->prog);
+		} else if(status==POSTL_ERROR){
+			fail(t->source,postl_error(t->prog));
+		} else {
+			t->finished=now()-start;
+			postl_stackval_t val=postl_stack_pop(t->prog);
+			if(t->runaway||val.type!=POSTL_NUM||val.numv!=t->expect)fail("wrong result",t->source);
+			postl_stackval_release(val);
+		}
+	}
+}
+
+// returns false on failure
+static bool run_tasks(int nthreads,bool slice,double *meanshort,double *maxshort,double *total){
+	sliced=slice;
+	ok=true;
+	ntasks=qhead=qlen=0;
+	char source[64];
+	for(int i=0;i<NLONG;i++){
+		snprintf(source,sizeof(source),"%d count",LONGN);
+		add_task(source,LONGN,false);
+	}
+	if(slice)add_task("1 { 1 } while",0,true);
+	for(int i=0;i<NSHORT;i++){
+		snprintf(source,sizeof(source),"%d count",SHORTN);
+		add_task(source,SHORTN,false);
+	}
+
+	pthread_t threads[nthreads];
+	start=now();
+	for(int i=0;i<nthreads;i++)start_thread(&threads[i],thread_main,NULL);
+	for(int i=0;i<nthreads;i++)pthread_join(threads[i],NULL);
+	*total=now()-start;
+
+	*meanshort=*maxshort=0;
+	for(int i=0;i<ntasks;i++){
+		task_t *t=&tasks[i];
+		if(t->expect==SHORTN){
+			*meanshort+=t->finished/NSHORT;
+			if(t->finished>*maxshort)*maxshort=t->finished;
+		}
+		postl_destroy(t->prog);
+	}
+	return ok;
+}
+
+// returns false on failure
+static bool run_straight_line(void){
+	char *source=xmalloc(4*STRAIGHTN+2);
+	strcpy(source,"0");
+	for(int i=0;i<STRAIGHTN;i++)strcpy(source+1+4*i," 1 +");
+	postl_program_t *prog=postl_makeprogram();
+	postl_set_budget(prog,SLICE,0);
+	int slices=1;
+	postl_status_t status=postl_runcode_step(prog,source,strlen(source));
+	while(status==POSTL_PREEMPTED&&slices<MAXSLICES){
+		status=postl_resume(prog);
+		slices++;
+	}
+	bool ok=status==POSTL_DONE;
+	if(!ok)fprintf(stderr,"straight-line script: %s\n",status==POSTL_PREEMPTED?"not done":postl_error(prog));
+	else {
+		postl_stackval_t val=postl_stack_pop(prog);
+		if(val.type!=POSTL_NUM||val.numv!=STRAIGHTN){
+			fprintf(stderr,"straight-line script: wrong result\n");
+			ok=false;
+		}
+		postl_stackval_release(val);
+	}
+	// Each '1 +' is at least one instruction
+	if(ok&&slices<STRAIGHTN/SLICE){
+		fprintf(stderr,"straight-line script: %d additions run in %d slices\n",STRAIGHTN,slices);
+		ok=false;
+	}
+	postl_destroy(prog);
+	free(source);
+	return ok;
+}
+
+static void* interrupter(void *arg){
+	struct timespec ts={0,50*1000*1000};
+	nanosleep(&ts,NULL);
+	postl_interrupt((postl_program_t*)arg);
+	return NULL;
+}
+
+int main(int argc,char **argv){
+	int nthreads=nthreads_arg(argc,argv,2);
+
+	double mean1,max1,total1,mean2,max2,total2;
+	if(!run_tasks(nthreads,false,&mean1,&max1,&total1))return 1;
+	if(!run_tasks(nthreads,true,&mean2,&max2,&total2))return 1;
+	printf("%d threads, %d long and %d short scripts\n",nthreads,NLONG,NSHORT);
+	printf("run to the end:  short scripts done after %.1f ms on average, %.1f ms at most; all done after %.1f ms\n",
+		mean1*1e3,max1*1e3,total1*1e3);
+	printf("time-sliced:     short scripts done after %.1f ms on average, %.1f ms at most; all done after %.1f ms\n",
+		mean2*1e3,max2*1e3,total2*1e3);
+	if(!run_straight_line())return 1;
+
+	postl_program_t *prog=postl_makeprogram();
+	pthread_t thread;
+	start_thread(&thread,interrupter,prog);
+	const char *errstr=postl_runcode(prog,"1 { 1 } while");
+	pthread_join(thread,NULL);
+	bool interrupted=errstr&&strcmp(errstr,"postl: Interrupted")==0;
+	postl_destroy(prog);
+	if(!interrupted){
+		fprintf(stderr,"not interrupted: %s\n",errstr?errstr:"(no error)");
+		return 1;
+	}
+}
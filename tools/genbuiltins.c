@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Generates builtins_phash.h: a perfect hash from builtin name to builtin_enum_t.
+// A name's slot is (namehash(name)*BUILTIN_PHASH_MULT)>>(32-BUILTIN_PHASH_BITS);
+// this program searches for a multiplier that gives every builtin its own slot,
+// in the smallest table where it finds one quickly.
+
+static const char *names[]={
+#define BUILTIN(e,n) n,
+#include "../builtins.def"
+#undef BUILTIN
+};
+
+#define NNAMES ((int)(sizeof(names)/sizeof(names[0])))
+#define MAXBITS 10
+
+// FNV-1a; must match namehash in postl.c
+static uint32_t namehash(const char *name,int len){
+	uint32_t h=2166136261u;
+	for(int i=0;i<len;i++){
+		h^=(unsigned char)name[i];
+		h*=16777619u;
+	}
+	return h;
+}
+
+int main(void){
+	uint32_t hashes[NNAMES];
+	for(int i=0;i<NNAMES;i++)hashes[i]=namehash(names[i],strlen(names[i]));
+
+	int table[1<<MAXBITS];
+	int bits,tablesz;
+	uint32_t mult=1,rng=2463534242u; // xorshift32, so the output is the same everywhere
+	bool found=false;
+	for(bits=7;;bits++){
+		if(bits>MAXBITS){
+			fprintf(stderr,"genbuiltins: no perfect hash found\n");
+			return 1;
+		}
+		tablesz=1<<bits;
+		if(NNAMES>tablesz/2)continue;
+		for(int attempt=0;attempt<1000000&&!found;attempt++){
+			rng^=rng<<13; rng^=rng>>17; rng^=rng<<5;
+			mult=rng|1;
+			for(int i=0;i<tablesz;i++)table[i]=-1;
+			int i;
+			for(i=0;i<NNAMES;i++){
+				uint32_t slot=(hashes[i]*mult)>>(32-bits);
+				if(table[slot]!=-1)break;
+				table[slot]=i;
+			}
+			found=i==NNAMES;
+		}
+		if(found)break;
+	}
+
+	printf("// Generated by tools/genbuiltins from builtins.def; do not edit.\n\n");
+	printf("#define BUILTIN_PHASH_MULT (%#xu)\n",mult);
+	printf("#define BUILTIN_PHASH_BITS (%d)\n\n",bits);
+	printf("static const signed char builtin_phash[%d]={",tablesz);
+	for(int i=0;i<tablesz;i++)printf("%s%d,",i%16==0?"\n\t":" ",table[i]);
+	printf("\n};\n\n");
+	printf("static const unsigned int builtin_hashes[%d]={",NNAMES);
+	for(int i=0;i<NNAMES;i++)printf("%s%#x,",i%6==0?"\n\t":" ",hashes[i]);
+	printf("\n};\n\n");
+	printf("static const unsigned char builtin_lens[%d]={",NNAMES);
+	for(int i=0;i<NNAMES;i++)printf("%s%d,",i%16==0?"\n\t":" ",(int)strlen(names[i]));
+	printf("\n};\n");
+	return 0;
+}